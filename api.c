@@ -2,42 +2,50 @@
 #include <curl/curl.h>
 #include <string.h>
 
-bool make_request(Request *request, Arena* arena) {
-    CURLcode res;
+bool prepare_request(Request *request, Arena* arena, PreparedRequest* prepared) {
+    *prepared = (PreparedRequest){0};
     LogInfo("Making request for: %s", request->url.data);
     CURL *curl = curl_easy_init();
     if (!curl) {
         LogError("Couldn't begin curl, ending...");
         return false;
     }
+    prepared->curl = curl;
 
-    struct curl_slist *headers = nullptr;
     VecForEach(request->headers, header) {
         String header_str = F(arena, "%s: %s", header->key.data, header->value.data);
-        headers = curl_slist_append(headers, header_str.data);
+        prepared->headers = curl_slist_append(prepared->headers, header_str.data);
     }
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, prepared->headers);
 
-    char *json_body = nullptr;
-    if (request->body.type == cJSON_Object || request->body.type == cJSON_Array) {
-        json_body = cJSON_PrintUnformatted(&request->body);
-    }
     curl_easy_setopt(curl, CURLOPT_URL, request->url.data);
-    if (json_body && json_body[0] != '\0') {
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_body);
+    if (!StrIsNull(request->body)) {
+        /* The size goes first, so curl never looks for a NUL terminator the slice doesn't have. */
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)request->body.length);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request->body.data);
+    }
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, symbol_string(request->method).data);
+    return true;
+}
+
+void release_request(PreparedRequest* prepared) {
+    if (prepared->headers) curl_slist_free_all(prepared->headers);
+    if (prepared->curl) curl_easy_cleanup(prepared->curl);
+    *prepared = (PreparedRequest){0};
+}
+
+bool make_request(Request *request, Arena* arena) {
+    PreparedRequest prepared;
+    if (!prepare_request(request, arena, &prepared)) {
+        return false;
     }
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request->method.data);
-    res = curl_easy_perform(curl);
+    const CURLcode res = curl_easy_perform(prepared.curl);
     if (res != CURLE_OK) {
         LogError("curl_easy_perform() failed: %s", curl_easy_strerror(res));
-        if (json_body) free(json_body);
-        if (headers) curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+        release_request(&prepared);
         return false;
     }
-    if (json_body) free(json_body);
-    if (headers) curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    release_request(&prepared);
     return true;
 
-}
\ No newline at end of file
+}
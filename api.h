@@ -1,5 +1,17 @@
 #pragma once
+#include <curl/curl.h>
 #include "library.h"
 
-bool make_request(Request* request, Arena* arena);
+/* A PreparedRequest is a configured curl easy handle plus the header list it owns, the body is borrowed from the
+ * delivery or the Request's Arena and must outlive the transfer. It can be run in place with make_request or handed
+ * over to a curl multi handle. */
+typedef struct {
+    CURL* curl;
+    struct curl_slist* headers;
+} PreparedRequest;
+
+bool prepare_request(Request* request, Arena* arena, PreparedRequest* prepared);
 
+void release_request(PreparedRequest* prepared);
+
+bool make_request(Request* request, Arena* arena);
@@ -1,6 +1,20 @@
 #include "config.h"
 #include "include/dotenv.h"
 #include "include/base.h"
+#include <rabbitmq-c/amqp.h>
+
+static i32 env_int(const char* name, i32 fallback, i32 min) {
+    char* value = getenv(name);
+    if (!value || value[0] == '\0') return fallback;
+    char* endptr;
+    errno = 0;
+    const long parsed = strtol(value, &endptr, 10);
+    if (*endptr != '\0' || errno != 0 || parsed < min || parsed > I32_MAX) {
+        LogWarn("Invalid value for %s: %s, using %d", name, value, fallback);
+        return fallback;
+    }
+    return (i32)parsed;
+}
 
 Dotenv* load_env(Arena* arena) {
     env_load("../.env", false);
@@ -8,6 +22,8 @@ Dotenv* load_env(Arena* arena) {
     char* rabbit_url = getenv("RABBIT_URL");
     char* db_url = getenv("DB_URL");
     char* redis_url = getenv("REDIS_URL");
+    char* outgoing_queue = getenv("OUTGOING_QUEUE");
+    char* incoming_queue = getenv("INCOMING_QUEUE");
 
     Dotenv* dotenv = ArenaAlloc(arena, sizeof(Dotenv));
 
@@ -29,5 +45,56 @@ Dotenv* load_env(Arena* arena) {
         dotenv->redis_url = (String){0};
     }
 
+    if (outgoing_queue) {
+        dotenv->outgoing_queue = StrNew(arena, outgoing_queue);
+    } else {
+        dotenv->outgoing_queue = StrNew(arena, "outgoing");
+    }
+
+    if (incoming_queue) {
+        dotenv->incoming_queue = StrNew(arena, incoming_queue);
+    } else {
+        dotenv->incoming_queue = StrNew(arena, "incoming");
+    }
+
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    dotenv->worker_count = env_int("WORKER_COUNT", cpus > 0 ? (i32)cpus : 1, 1);
+    dotenv->prefetch_count = Min(env_int("PREFETCH_COUNT", 256, 1), U16_MAX);
+    dotenv->ack_batch = Min(env_int("ACK_BATCH", 64, 1), dotenv->prefetch_count);
+    dotenv->ack_interval_ms = env_int("ACK_INTERVAL_MS", 50, 1);
+    dotenv->upsert_batch = Min(env_int("UPSERT_BATCH", 128, 1), dotenv->prefetch_count);
+    dotenv->upsert_batch_ms = env_int("UPSERT_BATCH_MS", 20, 1);
+    dotenv->db_pipeline = env_int("DB_PIPELINE", 0, 0) != 0;
+    dotenv->bulk_queue_depth = env_int("BULK_QUEUE_DEPTH", 10000, 0);
+    dotenv->bulk_batch = Min(env_int("BULK_BATCH", dotenv->prefetch_count, 1), dotenv->prefetch_count);
+    dotenv->db_pool_size = env_int("DB_POOL_SIZE", dotenv->worker_count, 1);
+    dotenv->db_pool_health_ms = env_int("DB_POOL_HEALTH_MS", 5000, 100);
+    dotenv->db_pool_timeout_ms = env_int("DB_POOL_TIMEOUT_MS", 1000, 1);
+    dotenv->incoming_workers = env_int("INCOMING_WORKERS", 1, 0);
+    dotenv->incoming_batch = Min(env_int("INCOMING_BATCH", 128, 1), dotenv->prefetch_count);
+
+    dotenv->amqp_frame_max = env_int("AMQP_FRAME_MAX", AMQP_DEFAULT_FRAME_SIZE, 4096);
+    dotenv->amqp_channel_max = env_int("AMQP_CHANNEL_MAX", 0, 0);
+    dotenv->amqp_heartbeat = env_int("AMQP_HEARTBEAT", 60, 0);
+    dotenv->reconnect_base_ms = env_int("RECONNECT_BASE_MS", 200, 1);
+    dotenv->reconnect_max_ms = env_int("RECONNECT_MAX_MS", 30000, 1);
+    /* A TTL near zero would bounce a failing delivery straight back onto its queue. */
+    dotenv->retry_delay_ms = env_int("RETRY_DELAY_MS", 5000, 100);
+    dotenv->retry_max_attempts = env_int("RETRY_MAX_ATTEMPTS", 5, 1);
+    dotenv->intern_max_symbols = env_int("INTERN_MAX_SYMBOLS", 4096, 1);
+
+    char* consumer_mode = getenv("CONSUMER_MODE");
+    if (consumer_mode && strcmp(consumer_mode, "eventloop") == 0) {
+        dotenv->mode = CONSUMER_EVENT_LOOP;
+    } else if (consumer_mode && strcmp(consumer_mode, "replay") == 0) {
+        dotenv->mode = CONSUMER_REPLAY;
+    } else {
+        dotenv->mode = CONSUMER_WORKERS;
+    }
+
+    char* replay_file = getenv("REPLAY_FILE");
+    dotenv->replay_file = StrNew(arena, replay_file && replay_file[0] ? replay_file : "requests.jsonl");
+    dotenv->replay_workers = env_int("REPLAY_WORKERS", dotenv->worker_count, 1);
+
     return dotenv;
 }
\ No newline at end of file
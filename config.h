@@ -4,10 +4,43 @@
 /* This is the Dotenv type, which will be used thorough the project to
  * load Environment variables, we are using one dependency here, to load the actual variables. */
 
+typedef enum {
+    CONSUMER_WORKERS = 0,
+    CONSUMER_EVENT_LOOP,
+    CONSUMER_REPLAY,
+} ConsumerMode;
+
 typedef struct {
     String rabbit_url;
     String db_url;
     String redis_url;
+    String outgoing_queue;
+    String incoming_queue;
+    i32 worker_count;
+    i32 incoming_workers;
+    i32 incoming_batch;
+    i32 prefetch_count;
+    i32 ack_batch;
+    i32 ack_interval_ms;
+    i32 upsert_batch;
+    i32 upsert_batch_ms;
+    bool db_pipeline;
+    i32 bulk_queue_depth;
+    i32 bulk_batch;
+    i32 db_pool_size;
+    i32 db_pool_health_ms;
+    i32 db_pool_timeout_ms;
+    i32 amqp_frame_max;
+    i32 amqp_channel_max;
+    i32 amqp_heartbeat;
+    i32 reconnect_base_ms;
+    i32 reconnect_max_ms;
+    i32 retry_delay_ms;
+    i32 retry_max_attempts;
+    i32 intern_max_symbols;
+    ConsumerMode mode;
+    String replay_file;
+    i32 replay_workers;
 } Dotenv;
 
-Dotenv* load_env(Arena* arena);
\ No newline at end of file
+Dotenv* load_env(Arena* arena);
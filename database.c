@@ -1,5 +1,11 @@
 #include "database.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
 
+static bool prepare_statements(PGconn* conn);
+
+/* Every connection gets the upsert statements prepared right away, a connection that can't prepare them is unusable. */
 PGconn* connect_db(char* db_url) {
     PGconn* conn = PQconnectdb(db_url);
     if (PQstatus(conn) != CONNECTION_OK) {
@@ -7,180 +13,754 @@ PGconn* connect_db(char* db_url) {
         PQfinish(conn);
         return nullptr;
     }
+    if (!prepare_statements(conn)) {
+        PQfinish(conn);
+        return nullptr;
+    }
     return conn;
 }
 
-void upsert_chats(PGconn* client, Chat* chat) {
-    if (PQstatus(client) != CONNECTION_OK) {
-        printf("Connection to DB failed: %s\n", PQerrorMessage(client));
-        PQfinish(client);
+/* ====== [SCHEMA SQL] ====== */
+
+typedef struct {
+    const char* column;
+    bool optional;
+    Oid type;
+    Oid array_type;
+    const char* staging_type;
+    const char* sql_type;
+} SchemaColumn;
+
+/* The rows of one table waiting in a DbBatch, slots index them by key (row + 1, 0 is free). */
+typedef struct {
+    void* rows;
+    i32* keys;
+    i32* slots;
+    i32 count;
+} BatchTable;
+
+#define DB_BATCH_TABLES 3
+
+struct DbBatch {
+    Arena* arena;
+    i32 capacity;
+    i32 slot_count;
+    BatchTable tables[DB_BATCH_TABLES];
+};
+
+typedef struct CopyStream CopyStream;
+
+/* One upsert per entity, rendered from its schema and prepared under its own name on every connection: once taking a
+ * single row as parameters and once taking a whole BatchTable as one array per column. The merge of whatever was
+ * copied into the connection's staging table is only prepared where a bulk batch is flushed. */
+typedef struct {
+    const char* name;
+    const char* batch_name;
+    const char* merge_name;
+    const char* table;
+    const char* staging;
+    const SchemaColumn* columns;
+    i32 column_count;
+    size_t row_size;
+    DbStatus (*write_batch)(PGconn* client, const BatchTable* table, Arena* arena);
+    void (*copy_rows)(CopyStream* stream, const BatchTable* table);
+    char sql[2048];
+    char batch_sql[2048];
+    char merge_sql[2048];
+    char staging_sql[512];
+    char copy_sql[512];
+} UpsertStatement;
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t length;
+} SqlBuffer;
+
+static void sql_append(SqlBuffer* sql, const char* format, ...) FORMAT_CHECK(2, 3);
+
+static void sql_append(SqlBuffer* sql, const char* format, ...) {
+    if (sql->length >= sql->size) return;
+    va_list args;
+    va_start(args, format);
+    sql->length += vsnprintf(sql->data + sql->length, sql->size - sql->length, format, args);
+    va_end(args);
+}
+
+typedef enum {
+    UPSERT_FROM_VALUES,
+    UPSERT_FROM_ARRAYS,
+    UPSERT_FROM_STAGING,
+} UpsertSource;
+
+static void sql_append_columns(SqlBuffer* sql, const SchemaColumn* columns, i32 count) {
+    for (i32 i = 0; i < count; i++) sql_append(sql, "%s\"%s\"", i ? ", " : "", columns[i].column);
+}
+
+/* Bit j of a mask is the j-th optional column of the schema, in order. */
+static bool column_in_mask(const SchemaColumn* columns, i32 index, u32 mask) {
+    if (!columns[index].optional) return true;
+    i32 bit = 0;
+    for (i32 i = 0; i < index; i++) bit += columns[i].optional;
+    return (mask >> bit) & 1;
+}
+
+static void sql_append_masked_columns(SqlBuffer* sql, const SchemaColumn* columns, i32 count, u32 mask) {
+    const char* separator = "";
+    for (i32 i = 0; i < count; i++) {
+        if (!column_in_mask(columns, i, mask)) continue;
+        sql_append(sql, "%s\"%s\"", separator, columns[i].column);
+        separator = ", ";
+    }
+}
+
+/* One INSERT for the rows whose optional columns are present exactly as in the mask. The absent ones are left out of
+ * both the column list and the update, so a new row gets their DEFAULT and a stored row keeps what it had. */
+static void sql_append_masked_insert(SqlBuffer* sql, const UpsertStatement* statement, u32 mask) {
+    const SchemaColumn* columns = statement->columns;
+    const i32 count = statement->column_count;
+    sql_append(sql, "INSERT INTO %s (", statement->table);
+    sql_append_masked_columns(sql, columns, count, mask);
+    sql_append(sql, ") SELECT ");
+    sql_append_masked_columns(sql, columns, count, mask);
+    sql_append(sql, " FROM source");
+    const char* keyword = " WHERE";
+    for (i32 i = 0; i < count; i++) {
+        if (!columns[i].optional) continue;
+        const char* present = column_in_mask(columns, i, mask) ? "NOT " : "";
+        sql_append(sql, "%s \"%s\" IS %sNULL", keyword, columns[i].column, present);
+        keyword = " AND";
+    }
+    sql_append(sql, " ON CONFLICT (\"%s\") DO ", columns[0].column);
+    i32 updated = 0;
+    for (i32 i = 1; i < count; i++) {
+        if (!column_in_mask(columns, i, mask)) continue;
+        const char* column = columns[i].column;
+        sql_append(sql, "%s\"%s\" = EXCLUDED.\"%s\"", updated++ ? ", " : "UPDATE SET ", column, column);
+    }
+    if (updated == 0) sql_append(sql, "NOTHING");
+}
+
+/* Every column is quoted, which is what lets "from" and "to" be used as column names at all. The first column is the
+ * conflict key. The rows come from the parameters of a single row, from unnest() over one array per column, or from
+ * the staging table, every value cast to its column's SQL type since nothing infers it from the table there. They are
+ * split by which optional columns arrived: every combination gets its own INSERT, all but the last as a data-modifying
+ * CTE, so NULL never reaches an optional column. */
+static void render_upsert_sql(char* data, size_t size, const UpsertStatement* statement, UpsertSource source) {
+    const SchemaColumn* columns = statement->columns;
+    const i32 count = statement->column_count;
+    SqlBuffer sql = { .data = data, .size = size };
+    sql_append(&sql, "WITH source (");
+    sql_append_columns(&sql, columns, count);
+    sql_append(&sql, ") AS (SELECT ");
+    for (i32 i = 0; i < count; i++) {
+        const char* separator = i ? ", " : "";
+        if (source == UPSERT_FROM_VALUES) sql_append(&sql, "%s$%d::%s", separator, i + 1, columns[i].sql_type);
+        else sql_append(&sql, "%s\"%s\"::%s", separator, columns[i].column, columns[i].sql_type);
+    }
+    if (source == UPSERT_FROM_STAGING) {
+        sql_append(&sql, " FROM %s)", statement->staging);
+    } else if (source == UPSERT_FROM_ARRAYS) {
+        sql_append(&sql, " FROM unnest(");
+        for (i32 i = 0; i < count; i++) sql_append(&sql, "%s$%d", i ? ", " : "", i + 1);
+        sql_append(&sql, ") AS unnested (");
+        sql_append_columns(&sql, columns, count);
+        sql_append(&sql, "))");
+    } else {
+        sql_append(&sql, ")");
+    }
+    i32 optional_count = 0;
+    for (i32 i = 0; i < count; i++) optional_count += columns[i].optional;
+    const u32 last = (1u << optional_count) - 1;
+    for (u32 mask = 0; mask < last; mask++) {
+        sql_append(&sql, ", upsert_%u AS (", mask);
+        sql_append_masked_insert(&sql, statement, mask);
+        sql_append(&sql, ")");
+    }
+    sql_append(&sql, " ");
+    sql_append_masked_insert(&sql, statement, last);
+    if (sql.length >= sql.size) LogError("Upsert SQL for %s was truncated at %zu bytes.", statement->table, size);
+}
+
+/* Staging tables are temporary, so every connection has its own, they are never WAL-logged, and committing empties
+ * them. Their columns have exactly the types the binary COPY sends, the merge casts them to their columns' SQL types. */
+static void render_staging_sql(UpsertStatement* statement) {
+    SqlBuffer sql = { .data = statement->staging_sql, .size = sizeof(statement->staging_sql) };
+    sql_append(&sql, "CREATE TEMP TABLE IF NOT EXISTS %s (", statement->staging);
+    for (i32 i = 0; i < statement->column_count; i++) {
+        const SchemaColumn* column = &statement->columns[i];
+        sql_append(&sql, "%s\"%s\" %s", i ? ", " : "", column->column, column->staging_type);
+    }
+    sql_append(&sql, ") ON COMMIT DELETE ROWS");
+    if (sql.length >= sql.size) LogError("Staging SQL for %s was truncated.", statement->table);
+
+    sql = (SqlBuffer){ .data = statement->copy_sql, .size = sizeof(statement->copy_sql) };
+    sql_append(&sql, "COPY %s (", statement->staging);
+    sql_append_columns(&sql, statement->columns, statement->column_count);
+    sql_append(&sql, ") FROM STDIN (FORMAT binary)");
+    if (sql.length >= sql.size) LogError("COPY SQL for %s was truncated.", statement->table);
+}
+
+static u8* put_be16(u8* out, u16 value) {
+    out[0] = (u8)(value >> 8);
+    out[1] = (u8)value;
+    return out + 2;
+}
+
+static u8* put_be32(u8* out, u32 value) {
+    out[0] = (u8)(value >> 24);
+    out[1] = (u8)(value >> 16);
+    out[2] = (u8)(value >> 8);
+    out[3] = (u8)value;
+    return out + 4;
+}
+
+/* Integers and booleans are sent in binary, text goes as it is. */
+static void bind_int4(DbQuery* query, i32 value) {
+    const i32 index = query->param_count++;
+    put_be32(query->binary[index], (u32)value);
+    query->values[index] = (const char*)query->binary[index];
+    query->lengths[index] = 4;
+    query->formats[index] = 1;
+}
+
+static void bind_bool(DbQuery* query, bool value) {
+    const i32 index = query->param_count++;
+    query->binary[index][0] = value ? 1 : 0;
+    query->values[index] = (const char*)query->binary[index];
+    query->lengths[index] = 1;
+    query->formats[index] = 1;
+}
+
+/* Only an optional column takes empty text as NULL, that is what leaves it out of the upsert. A required one gets the
+ * empty string. */
+static void bind_text(DbQuery* query, String value, bool optional) {
+    const bool empty = StrIsNull(value) || value.length == 0;
+    query->values[query->param_count++] = !empty ? value.data : optional ? NULL : "";
+}
+
+/* Postgres type OIDs of the parameters. Text parameters are sent untyped, the upsert casts every one of them to its
+ * column's SQL type. */
+#define PG_TYPE_INT4 23
+#define PG_TYPE_BOOL 16
+#define PG_TYPE_TEXT 25
+#define PG_TYPE_INT4_ARRAY 1007
+#define PG_TYPE_BOOL_ARRAY 1000
+#define PG_TYPE_TEXT_ARRAY 1009
+
+/* Arrays always go in the binary array format: one dimension, whether any element is NULL, the element type, the
+ * length and a lower bound of 1, then every element as its byte length (-1 for NULL) followed by its bytes. The
+ * elements are read from a column of rows, stride bytes apart. */
+static u8* bind_array(DbQuery* query, Arena* arena, size_t elements_size, bool nulls, Oid element_type, i32 count) {
+    const i32 index = query->param_count++;
+    u8* out = ArenaAlloc(arena, 20 + elements_size);
+    query->values[index] = (const char*)out;
+    query->lengths[index] = (int)(20 + elements_size);
+    query->formats[index] = 1;
+    out = put_be32(out, 1);
+    out = put_be32(out, nulls ? 1 : 0);
+    out = put_be32(out, element_type);
+    out = put_be32(out, (u32)count);
+    return put_be32(out, 1);
+}
+
+#define BATCH_FIELD(Type, field, stride, i) (*(const Type*)((const u8*)(field) + (size_t)(i) * (stride)))
+
+static void bind_int4_array(DbQuery* query, Arena* arena, const i32* field, size_t stride, i32 count) {
+    u8* out = bind_array(query, arena, (size_t)count * 8, false, PG_TYPE_INT4, count);
+    for (i32 i = 0; i < count; i++) {
+        out = put_be32(out, 4);
+        out = put_be32(out, (u32)BATCH_FIELD(i32, field, stride, i));
+    }
+}
+
+static void bind_bool_array(DbQuery* query, Arena* arena, const bool* field, size_t stride, i32 count) {
+    u8* out = bind_array(query, arena, (size_t)count * 5, false, PG_TYPE_BOOL, count);
+    for (i32 i = 0; i < count; i++) {
+        out = put_be32(out, 1);
+        *out++ = BATCH_FIELD(bool, field, stride, i) ? 1 : 0;
+    }
+}
+
+/* Empty text is NULL in an optional column and the empty string in a required one, like bind_text. */
+static void bind_text_array(DbQuery* query, Arena* arena, const String* field, size_t stride, i32 count, bool optional) {
+    size_t size = 0;
+    bool nulls = false;
+    for (i32 i = 0; i < count; i++) {
+        const String value = BATCH_FIELD(String, field, stride, i);
+        size += 4 + value.length;
+        nulls |= optional && value.length == 0;
+    }
+    u8* out = bind_array(query, arena, size, nulls, PG_TYPE_TEXT, count);
+    for (i32 i = 0; i < count; i++) {
+        const String value = BATCH_FIELD(String, field, stride, i);
+        out = put_be32(out, value.length > 0 || !optional ? (u32)value.length : U32_MAX);
+        if (value.length > 0) memcpy(out, value.data, value.length);
+        out += value.length;
+    }
+}
+
+static void bind_symbol_array(DbQuery* query, Arena* arena, const Symbol* field, size_t stride, i32 count, bool optional) {
+    String* values = ArenaAlloc(arena, sizeof(String) * Max(count, 1));
+    for (i32 i = 0; i < count; i++) values[i] = symbol_string(BATCH_FIELD(Symbol, field, stride, i));
+    bind_text_array(query, arena, values, sizeof(String), count, optional);
+}
+
+/* Rows go to COPY in its binary format: a signature, flags and header extension, then per row its field count and
+ * every field as its byte length (-1 for NULL) and bytes, and a field count of -1 at the end. They are streamed to
+ * the server in chunks as they are encoded. */
+#define COPY_CHUNK_SIZE (64 * 1024)
+
+struct CopyStream {
+    PGconn* client;
+    bool failed;
+    size_t length;
+    u8 data[COPY_CHUNK_SIZE];
+};
+
+static void copy_flush(CopyStream* stream) {
+    if (stream->length > 0 && !stream->failed && PQputCopyData(stream->client, (const char*)stream->data, (int)stream->length) != 1) {
+        LogError("COPY failed: %s", PQerrorMessage(stream->client));
+        stream->failed = true;
+    }
+    stream->length = 0;
+}
+
+static void copy_write(CopyStream* stream, const void* data, size_t length) {
+    if (stream->length + length > COPY_CHUNK_SIZE) copy_flush(stream);
+    if (length > COPY_CHUNK_SIZE) {
+        if (!stream->failed && PQputCopyData(stream->client, data, (int)length) != 1) stream->failed = true;
         return;
     }
+    memcpy(stream->data + stream->length, data, length);
+    stream->length += length;
+}
 
-    PGresult *res = nullptr;
-
-    if (strcmp(chat->tabulation.data, "") == 0 ) {
-        const char *paramValues[5];
-        paramValues[0] = chat->id;
-        paramValues[1] = chat->situation.data;
-        paramValues[2] = chat->is_active ? "1" : "0";
-        paramValues[3] = chat->agent_id;
-        paramValues[4] = chat->customer_id;
-        res = PQexecParams(
-            client,
-            "INSERT INTO chats (id, situation, is_active, agent_id, customer_id) VALUES ($1, $2, $3, $4, $5) ON CONFLICT (id) DO UPDATE SET situation = $2, is_active = $3, agent_id = $4, customer_id = $5",
-            5,
-            NULL,
-            paramValues,
-            NULL,
-            NULL,
-            0);
-        if (res == NULL) {
-            printf("Insert failed: could not allocate result.\n");
-            return;
-        }
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            printf("Insert failed: %s\n", PQresultErrorMessage(res));
-        } else {
-            printf("Insert successfull!\n");
+static void copy_be16(CopyStream* stream, u16 value) {
+    u8 bytes[2];
+    put_be16(bytes, value);
+    copy_write(stream, bytes, 2);
+}
+
+static void copy_be32(CopyStream* stream, u32 value) {
+    u8 bytes[4];
+    put_be32(bytes, value);
+    copy_write(stream, bytes, 4);
+}
+
+static void copy_int4(CopyStream* stream, i32 value) {
+    copy_be32(stream, 4);
+    copy_be32(stream, (u32)value);
+}
+
+static void copy_bool(CopyStream* stream, bool value) {
+    const u8 bytes[5] = { 0, 0, 0, 1, value ? 1 : 0 };
+    copy_write(stream, bytes, 5);
+}
+
+/* Empty text is NULL, like bind_text. */
+static void copy_text(CopyStream* stream, String value, bool optional) {
+    if (StrIsNull(value) || value.length == 0) {
+        copy_be32(stream, optional ? U32_MAX : 0);
+        return;
+    }
+    copy_be32(stream, (u32)value.length);
+    copy_write(stream, value.data, value.length);
+}
+
+/* Copies of the text a batched row keeps, the entity it came from is gone by the time the batch is written. */
+static String batch_text(Arena* arena, String value) {
+    if (StrIsNull(value) || value.length == 0) return (String){0};
+    return StrNewSize(arena, value.data, value.length);
+}
+
+static BatchTable* batch_table(DbBatch* batch, const UpsertStatement* statement);
+static i32 batch_row(DbBatch* batch, BatchTable* table, i32 key, bool* fresh);
+static DbStatus exec_query(PGconn* client, const DbQuery* query);
+
+#define SCHEMA_PG_TYPE_INT PG_TYPE_INT4
+#define SCHEMA_PG_TYPE_BOOL PG_TYPE_BOOL
+#define SCHEMA_PG_TYPE_TEXT 0
+#define SCHEMA_PG_TYPE_SYMBOL 0
+
+#define SCHEMA_PG_NAME_INT "int4"
+#define SCHEMA_PG_NAME_BOOL "bool"
+#define SCHEMA_PG_NAME_TEXT "text"
+#define SCHEMA_PG_NAME_SYMBOL "text"
+
+#define SCHEMA_PG_ARRAY_INT PG_TYPE_INT4_ARRAY
+#define SCHEMA_PG_ARRAY_BOOL PG_TYPE_BOOL_ARRAY
+#define SCHEMA_PG_ARRAY_TEXT PG_TYPE_TEXT_ARRAY
+#define SCHEMA_PG_ARRAY_SYMBOL PG_TYPE_TEXT_ARRAY
+
+#define SCHEMA_BIND_INT(query, value, optional) bind_int4(query, value)
+#define SCHEMA_BIND_TEXT(query, value, optional) bind_text(query, value, optional)
+#define SCHEMA_BIND_SYMBOL(query, value, optional) bind_text(query, symbol_string(value), optional)
+#define SCHEMA_BIND_BOOL(query, value, optional) bind_bool(query, value)
+#define SCHEMA_BIND_FIELD(kind, name, presence, column_type) \
+    SCHEMA_BIND_##kind(query, entity->name, SCHEMA_OPTIONAL_##presence);
+
+#define SCHEMA_BIND_ARRAY_INT(query, arena, field, stride, count, optional) bind_int4_array(query, arena, field, stride, count)
+#define SCHEMA_BIND_ARRAY_TEXT bind_text_array
+#define SCHEMA_BIND_ARRAY_SYMBOL bind_symbol_array
+#define SCHEMA_BIND_ARRAY_BOOL(query, arena, field, stride, count, optional) bind_bool_array(query, arena, field, stride, count)
+#define SCHEMA_BIND_ARRAY_FIELD(kind, name, presence, column_type) \
+    SCHEMA_BIND_ARRAY_##kind(&query, arena, &rows->name, sizeof(*rows), table->count, SCHEMA_OPTIONAL_##presence);
+
+#define SCHEMA_COPY_INT(stream, value, optional) copy_int4(stream, value)
+#define SCHEMA_COPY_TEXT(stream, value, optional) copy_text(stream, value, optional)
+#define SCHEMA_COPY_SYMBOL(stream, value, optional) copy_text(stream, symbol_string(value), optional)
+#define SCHEMA_COPY_BOOL(stream, value, optional) copy_bool(stream, value)
+#define SCHEMA_COPY_FIELD(kind, name, presence, column_type) \
+    SCHEMA_COPY_##kind(stream, entity->name, SCHEMA_OPTIONAL_##presence);
+
+/* A later row overwrites an earlier one with the same key, only an optional field arriving empty keeps what was there. */
+#define SCHEMA_MERGE_INT(field, value, optional) field = value
+#define SCHEMA_MERGE_BOOL(field, value, optional) field = value
+#define SCHEMA_MERGE_SYMBOL(field, value, optional) if (!(optional) || value) field = value
+#define SCHEMA_MERGE_TEXT(field, value, optional) \
+    if (!(optional) || value.length > 0) field = batch_text(batch->arena, value)
+#define SCHEMA_MERGE_FIELD(kind, name, presence, column_type) SCHEMA_MERGE_##kind(row->name, entity->name, SCHEMA_OPTIONAL_##presence);
+
+#define SCHEMA_COLUMN(kind, name, presence, column_type) \
+    { .column = #name, .optional = SCHEMA_OPTIONAL_##presence, .type = SCHEMA_PG_TYPE_##kind,    \
+      .array_type = SCHEMA_PG_ARRAY_##kind, .staging_type = SCHEMA_PG_NAME_##kind, .sql_type = column_type },
+
+/* The builder only binds the parameters in schema order, the statement is already prepared on the connection. The
+ * adder finds a batched row by the first field, the conflict key, which therefore has to be an INT. */
+#define SCHEMA_UPSERT(Type, function, adder, TABLE, SCHEMA)                                                 \
+    static_assert(SCHEMA_FIELD_COUNT(SCHEMA) <= DB_MAX_PARAMS, #Type " has more fields than DB_MAX_PARAMS"); \
+    static const SchemaColumn function##_columns[] = { SCHEMA(SCHEMA_COLUMN) };                              \
+    static DbStatus function##_batch(PGconn* client, const BatchTable* table, Arena* arena);                \
+    static void function##_copy(CopyStream* stream, const BatchTable* table);                               \
+    static UpsertStatement function##_statement = {                                                         \
+        .name = "upsert_" TABLE,                                                                            \
+        .batch_name = "upsert_" TABLE "_batch",                                                             \
+        .merge_name = "merge_" TABLE,                                                                       \
+        .table = TABLE,                                                                                     \
+        .staging = "staging_" TABLE,                                                                        \
+        .columns = function##_columns,                                                                      \
+        .column_count = SCHEMA_FIELD_COUNT(SCHEMA),                                                         \
+        .row_size = sizeof(Type),                                                                           \
+        .write_batch = function##_batch,                                                                    \
+        .copy_rows = function##_copy,                                                                       \
+    };                                                                                                      \
+    void function(DbQuery* query, const Type* entity) {                                                     \
+        *query = (DbQuery){ .statement = function##_statement.name };                                       \
+        SCHEMA(SCHEMA_BIND_FIELD)                                                                           \
+    }                                                                                                       \
+    bool adder(DbBatch* batch, const Type* entity) {                                                        \
+        BatchTable* table = batch_table(batch, &function##_statement);                                      \
+        bool fresh;                                                                                         \
+        const i32 index = batch_row(batch, table, *(const i32*)entity, &fresh);                             \
+        if (index < 0) return false;                                                                        \
+        Type* row = (Type*)table->rows + index;                                                             \
+        if (fresh) *row = (Type){0};                                                                        \
+        SCHEMA(SCHEMA_MERGE_FIELD)                                                                          \
+        return true;                                                                                        \
+    }                                                                                                       \
+    static DbStatus function##_batch(PGconn* client, const BatchTable* table, Arena* arena) {               \
+        const Type* rows = table->rows;                                                                     \
+        DbQuery query = { .statement = function##_statement.batch_name };                                   \
+        SCHEMA(SCHEMA_BIND_ARRAY_FIELD)                                                                     \
+        return exec_query(client, &query);                                                                  \
+    }                                                                                                       \
+    static void function##_copy(CopyStream* stream, const BatchTable* table) {                              \
+        const Type* rows = table->rows;                                                                     \
+        for (i32 i = 0; i < table->count; i++) {                                                            \
+            const Type* entity = &rows[i];                                                                  \
+            copy_be16(stream, SCHEMA_FIELD_COUNT(SCHEMA));                                                  \
+            SCHEMA(SCHEMA_COPY_FIELD)                                                                       \
+        }                                                                                                   \
+    }
+
+SCHEMA_UPSERT(Chat, build_chat_upsert, db_batch_add_chat, CHAT_TABLE, CHAT_SCHEMA)
+SCHEMA_UPSERT(Message, build_message_upsert, db_batch_add_message, MESSAGE_TABLE, MESSAGE_SCHEMA)
+SCHEMA_UPSERT(Customer, build_customer_upsert, db_batch_add_customer, CUSTOMER_TABLE, CUSTOMER_SCHEMA)
+
+/* A batch writes its tables in this order, so a chat lands after its customer and a message after its chat. */
+static UpsertStatement* const upsert_statements[] = {
+    &build_customer_upsert_statement,
+    &build_chat_upsert_statement,
+    &build_message_upsert_statement,
+};
+#define UPSERT_STATEMENT_COUNT ((i32)(sizeof(upsert_statements) / sizeof(upsert_statements[0])))
+static_assert(UPSERT_STATEMENT_COUNT == DB_BATCH_TABLES, "every upsert needs its DbBatch table");
+
+static pthread_once_t render_once = PTHREAD_ONCE_INIT;
+
+static void render_statements(void) {
+    for (i32 i = 0; i < UPSERT_STATEMENT_COUNT; i++) {
+        UpsertStatement* statement = upsert_statements[i];
+        render_upsert_sql(statement->sql, sizeof(statement->sql), statement, UPSERT_FROM_VALUES);
+        render_upsert_sql(statement->batch_sql, sizeof(statement->batch_sql), statement, UPSERT_FROM_ARRAYS);
+        render_upsert_sql(statement->merge_sql, sizeof(statement->merge_sql), statement, UPSERT_FROM_STAGING);
+        render_staging_sql(statement);
+    }
+}
+
+static bool prepare_statement(PGconn* conn, const char* name, const char* sql, i32 count, const Oid* types) {
+    PGresult* res = PQprepare(conn, name, sql, count, types);
+    const bool ok = res && PQresultStatus(res) == PGRES_COMMAND_OK;
+    if (!ok) LogError("Couldn't prepare %s: %s", name, res ? PQresultErrorMessage(res) : PQerrorMessage(conn));
+    if (res) PQclear(res);
+    return ok;
+}
+
+static bool prepare_statements(PGconn* conn) {
+    pthread_once(&render_once, render_statements);
+    for (i32 i = 0; i < UPSERT_STATEMENT_COUNT; i++) {
+        const UpsertStatement* statement = upsert_statements[i];
+        Oid types[DB_MAX_PARAMS];
+        Oid array_types[DB_MAX_PARAMS];
+        for (i32 c = 0; c < statement->column_count; c++) {
+            types[c] = statement->columns[c].type;
+            array_types[c] = statement->columns[c].array_type;
         }
-    } else {
-        const char *paramValues[6];
-        paramValues[0] = chat->id;
-        paramValues[1] = chat->situation.data;
-        paramValues[2] = chat->is_active ? "1" : "0";
-        paramValues[3] = chat->agent_id;
-        paramValues[4] = chat->customer_id;
-        paramValues[5] = chat->tabulation.data;
-        res = PQexecParams(
-            client,
-            "INSERT INTO chats (id, situation, is_active, agent_id, customer_id, tabulation) VALUES ($1, $2, $3, $4, $5, $6) ON CONFLICT (id) DO UPDATE SET situation = $2, is_active = $3, agent_id = $4, tabulation = $6, customer_id = $5",
-            6,
-            NULL,
-            paramValues,
-            NULL,
-            NULL,
-            0);
-        if (res == NULL) {
-            printf("Insert failed: could not allocate result.\n");
-            return;
+        if (!prepare_statement(conn, statement->name, statement->sql, statement->column_count, types) ||
+            !prepare_statement(conn, statement->batch_name, statement->batch_sql, statement->column_count, array_types)) {
+            return false;
         }
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            printf("Insert failed: %s\n", PQresultErrorMessage(res));
-        } else {
-            printf("Insert successfull!\n");
+    }
+    return true;
+}
+
+/* ====== [SCHEMA SQL] ====== */
+
+
+/* ====== [BATCH] ====== */
+
+DbBatch* db_batch_new(i32 capacity) {
+    DbBatch* batch = Malloc(sizeof(DbBatch));
+    *batch = (DbBatch){0};
+    batch->arena = ArenaCreate(1024 * 1024);
+    batch->capacity = capacity > 0 ? capacity : 1;
+    batch->slot_count = 1;
+    while (batch->slot_count < batch->capacity * 2) batch->slot_count <<= 1;
+    for (i32 i = 0; i < DB_BATCH_TABLES; i++) {
+        BatchTable* table = &batch->tables[i];
+        table->rows = Malloc(upsert_statements[i]->row_size * batch->capacity);
+        table->keys = Malloc(sizeof(i32) * batch->capacity);
+        table->slots = Malloc(sizeof(i32) * batch->slot_count);
+    }
+    db_batch_reset(batch);
+    return batch;
+}
+
+void db_batch_reset(DbBatch* batch) {
+    ArenaReset(batch->arena);
+    for (i32 i = 0; i < DB_BATCH_TABLES; i++) {
+        memset(batch->tables[i].slots, 0, sizeof(i32) * batch->slot_count);
+        batch->tables[i].count = 0;
+    }
+}
+
+void db_batch_free(DbBatch* batch) {
+    if (!batch) return;
+    for (i32 i = 0; i < DB_BATCH_TABLES; i++) {
+        Free(batch->tables[i].rows);
+        Free(batch->tables[i].keys);
+        Free(batch->tables[i].slots);
+    }
+    ArenaFree(batch->arena);
+    Free(batch);
+}
+
+i32 db_batch_rows(const DbBatch* batch) {
+    i32 rows = 0;
+    for (i32 i = 0; i < DB_BATCH_TABLES; i++) rows += batch->tables[i].count;
+    return rows;
+}
+
+static BatchTable* batch_table(DbBatch* batch, const UpsertStatement* statement) {
+    i32 i = 0;
+    while (upsert_statements[i] != statement) i++;
+    return &batch->tables[i];
+}
+
+/* Finds the row waiting under a key or claims a new one, -1 once the table is full. */
+static i32 batch_row(DbBatch* batch, BatchTable* table, i32 key, bool* fresh) {
+    const u32 mask = (u32)batch->slot_count - 1;
+    u32 slot = ((u32)key * 2654435761u) & mask;
+    while (table->slots[slot]) {
+        const i32 row = table->slots[slot] - 1;
+        if (table->keys[row] == key) {
+            *fresh = false;
+            return row;
         }
+        slot = (slot + 1) & mask;
     }
+    if (table->count == batch->capacity) return -1;
+    *fresh = true;
+    table->keys[table->count] = key;
+    table->slots[slot] = ++table->count;
+    return table->count - 1;
+}
 
-    if (res != NULL) {
+/* Only connections that flush a bulk batch get a staging table and its merge, created by the first such flush. It is
+ * checked before the transaction starts, asking for a statement that isn't prepared fails the transaction it is in. */
+static bool prepare_staging(PGconn* client, const UpsertStatement* statement) {
+    PGresult* res = PQdescribePrepared(client, statement->merge_name);
+    const bool prepared = res && PQresultStatus(res) == PGRES_COMMAND_OK;
+    if (res) PQclear(res);
+    if (prepared) return true;
+    return db_command(client, statement->staging_sql) == DB_OK &&
+           prepare_statement(client, statement->merge_name, statement->merge_sql, 0, nullptr);
+}
+
+/* The rows are streamed into the staging table and merged from there with one statement. */
+static DbStatus copy_table(PGconn* client, const UpsertStatement* statement, const BatchTable* table) {
+    PGresult* res = PQexec(client, statement->copy_sql);
+    const bool started = res && PQresultStatus(res) == PGRES_COPY_IN;
+    if (!started) LogError("%s failed: %s", statement->copy_sql, res ? PQresultErrorMessage(res) : PQerrorMessage(client));
+    if (res) PQclear(res);
+    if (!started) return PQstatus(client) == CONNECTION_OK ? DB_QUERY_FAILED : DB_CONNECTION_LOST;
+
+    CopyStream* stream = Malloc(sizeof(CopyStream));
+    *stream = (CopyStream){ .client = client };
+    copy_write(stream, "PGCOPY\n\377\r\n", 11);
+    copy_be32(stream, 0);
+    copy_be32(stream, 0);
+    statement->copy_rows(stream, table);
+    copy_be16(stream, U16_MAX);
+    copy_flush(stream);
+    const bool sent = !stream->failed;
+    Free(stream);
+
+    bool ok = PQputCopyEnd(client, sent ? NULL : "client failed to send rows") == 1;
+    while ((res = PQgetResult(client))) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            LogError("COPY into %s failed: %s", statement->staging, PQresultErrorMessage(res));
+            ok = false;
+        }
         PQclear(res);
     }
+    if (!ok || !sent) return PQstatus(client) == CONNECTION_OK ? DB_QUERY_FAILED : DB_CONNECTION_LOST;
 
+    const DbQuery merge = { .statement = statement->merge_name };
+    return exec_query(client, &merge);
 }
 
-void upsert_messages(PGconn* client, Message* messages) {
+/* A single table written through unnest() is one statement and needs no transaction around it, the staging tables
+ * always do, they are emptied by every commit. A failed statement rolls back the whole batch, which the caller then
+ * has to write row by row to find the row that was refused. */
+DbStatus db_batch_flush(PGconn* client, DbBatch* batch, bool bulk) {
+    i32 tables = 0;
+    for (i32 i = 0; i < DB_BATCH_TABLES; i++) tables += batch->tables[i].count > 0;
+    if (tables == 0) return DB_OK;
     if (PQstatus(client) != CONNECTION_OK) {
         printf("Connection to DB failed: %s\n", PQerrorMessage(client));
-        PQfinish(client);
-        return;
+        db_batch_reset(batch);
+        return DB_CONNECTION_LOST;
     }
 
-    PGresult *res = nullptr;
-
-        const char *paramValues[6];
-        paramValues[0] = messages->id;
-        paramValues[1] = messages->from.data;
-        paramValues[2] = messages->to.data;
-        paramValues[3] = messages->text.data;
-        paramValues[4] = messages->delivered ? "1" : "0";
-        paramValues[5] = messages->chat_id;
-
-        res = PQexecParams(
-            client,
-            "INSERT INTO messages (id, from, to, text, delivered, chat_id) VALUES ($1, $2, $3, $4, $5, $6) ON CONFLICT (id) DO UPDATE SET from = $2, to = $3, text = $4, delivered = $5, chat_id = $6",
-            6,
-            NULL,
-            paramValues,
-            NULL,
-            NULL,
-            0);
-        if (res == NULL) {
-            printf("Insert failed: could not allocate result.\n");
-            return;
-        }
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            printf("Insert failed: %s\n", PQresultErrorMessage(res));
-        } else {
-            printf("Insert successfull!\n");
-        }
+    const i32 rows = db_batch_rows(batch);
+    const bool transaction = tables > 1 || bulk;
+    DbStatus status = DB_OK;
+    for (i32 i = 0; i < DB_BATCH_TABLES && bulk && status == DB_OK; i++) {
+        if (batch->tables[i].count == 0 || prepare_staging(client, upsert_statements[i])) continue;
+        status = PQstatus(client) == CONNECTION_OK ? DB_QUERY_FAILED : DB_CONNECTION_LOST;
+    }
+    const bool began = transaction && status == DB_OK;
+    if (began) status = db_command(client, "BEGIN");
+    for (i32 i = 0; i < DB_BATCH_TABLES && status == DB_OK; i++) {
+        const UpsertStatement* statement = upsert_statements[i];
+        const BatchTable* table = &batch->tables[i];
+        if (table->count == 0) continue;
+        status = bulk ? copy_table(client, statement, table) : statement->write_batch(client, table, batch->arena);
+    }
+    if (began) {
+        if (status == DB_OK) status = db_command(client, "COMMIT");
+        else if (status == DB_QUERY_FAILED) db_command(client, "ROLLBACK");
+    }
+    if (status == DB_OK) LogSuccess("Upserted %d batched rows into %d tables%s.", rows, tables, bulk ? " through COPY" : "");
+    db_batch_reset(batch);
+    return status;
+}
+
+/* ====== [BATCH] ====== */
+
+bool db_send_query(PGconn* client, const DbQuery* query) {
+    const int sent = query->statement
+        ? PQsendQueryPrepared(client, query->statement, query->param_count, query->values, query->lengths, query->formats, 0)
+        : PQsendQueryParams(client, query->sql, query->param_count, NULL, query->values, query->lengths, query->formats, 0);
+    if (!sent) {
+        printf("Insert failed: %s\n", PQerrorMessage(client));
+        return false;
+    }
+    return true;
+}
+
+bool db_report_result(PGresult* res) {
+    if (res == NULL) {
+        printf("Insert failed: could not allocate result.\n");
+        return false;
+    }
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        printf("Insert failed: %s\n", PQresultErrorMessage(res));
+        return false;
+    }
+    printf("Insert successfull!\n");
+    return true;
+}
 
+/* A failed statement only loses the message, a failed connection has to be re-established by the caller. */
+static DbStatus exec_query(PGconn* client, const DbQuery* query) {
+    PGresult *res = PQexecPrepared(
+        client,
+        query->statement,
+        query->param_count,
+        query->values,
+        query->lengths,
+        query->formats,
+        0);
+    const bool ok = db_report_result(res);
     if (res != NULL) {
         PQclear(res);
     }
+    if (ok) return DB_OK;
+    return PQstatus(client) == CONNECTION_OK ? DB_QUERY_FAILED : DB_CONNECTION_LOST;
+}
 
+/* For statements without parameters or rows, like the BEGIN and COMMIT around an envelope. */
+DbStatus db_command(PGconn* client, const char* sql) {
+    PGresult* res = PQexec(client, sql);
+    const bool ok = res && PQresultStatus(res) == PGRES_COMMAND_OK;
+    if (!ok) LogError("%s failed: %s", sql, res ? PQresultErrorMessage(res) : PQerrorMessage(client));
+    if (res) PQclear(res);
+    if (ok) return DB_OK;
+    return PQstatus(client) == CONNECTION_OK ? DB_QUERY_FAILED : DB_CONNECTION_LOST;
 }
 
-void upsert_customer(PGconn* client, Customer* customer) {
+DbStatus upsert_chats(PGconn* client, Chat* chat) {
     if (PQstatus(client) != CONNECTION_OK) {
         printf("Connection to DB failed: %s\n", PQerrorMessage(client));
-        PQfinish(client);
-        return;
+        return DB_CONNECTION_LOST;
     }
 
-    PGresult *res = nullptr;
-
-    if (strcmp(customer->last_chat_id.data, "") == 0 ) {
-        const char *paramValues[3];
-        paramValues[0] = customer->id;
-        paramValues[1] = customer->name.data;
-        paramValues[2] = customer->number.data;
-        res = PQexecParams(
-            client,
-            "INSERT INTO customers (id, name, number) VALUES ($1, $2, $3) ON CONFLICT (id) DO UPDATE SET name = $2, number = $3",
-            3,
-            NULL,
-            paramValues,
-            NULL,
-            NULL,
-            0);
-        if (res == NULL) {
-            printf("Insert failed: could not allocate result.\n");
-            return;
-        }
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            printf("Insert failed: %s\n", PQresultErrorMessage(res));
-        } else {
-            printf("Insert successfull!\n");
-        }
-    } else {
-        const char *paramValues[4];
-        paramValues[0] = customer->id;
-        paramValues[1] = customer->name.data;
-        paramValues[2] = customer->number.data;
-        paramValues[3] = customer->last_chat_id.data;
-
-        res = PQexecParams(
-            client,
-            "INSERT INTO customers (id, name, number, last_chat_id) VALUES ($1, $2, $3, $4) ON CONFLICT (id) DO UPDATE SET name = $2, number = $3, last_chat_Id = $4",
-            4,
-            NULL,
-            paramValues,
-            NULL,
-            NULL,
-            0);
-        if (res == NULL) {
-            printf("Insert failed: could not allocate result.\n");
-            return;
-        }
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            printf("Insert failed: %s\n", PQresultErrorMessage(res));
-        } else {
-            printf("Insert successfull!\n");
-        }
+    DbQuery query;
+    build_chat_upsert(&query, chat);
+    return exec_query(client, &query);
+}
+
+DbStatus upsert_messages(PGconn* client, Message* messages) {
+    if (PQstatus(client) != CONNECTION_OK) {
+        printf("Connection to DB failed: %s\n", PQerrorMessage(client));
+        return DB_CONNECTION_LOST;
     }
 
-    if (res != NULL) {
-        PQclear(res);
+    DbQuery query;
+    build_message_upsert(&query, messages);
+    return exec_query(client, &query);
+}
+
+DbStatus upsert_customer(PGconn* client, Customer* customer) {
+    if (PQstatus(client) != CONNECTION_OK) {
+        printf("Connection to DB failed: %s\n", PQerrorMessage(client));
+        return DB_CONNECTION_LOST;
     }
 
-}
\ No newline at end of file
+    DbQuery query;
+    build_customer_upsert(&query, customer);
+    return exec_query(client, &query);
+}
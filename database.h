@@ -3,10 +3,68 @@
 #include <libpq-fe.h>
 #include "library.h"
 
+#define DB_MAX_PARAMS 6
+
+/* A DbQuery is either one prepared upsert with its parameters or plain SQL without any. Integer and boolean
+ * parameters are encoded in binary into the query's own storage, so a built DbQuery must stay where it was built. */
+typedef struct {
+    const char* statement;
+    const char* sql;
+    int param_count;
+    const char* values[DB_MAX_PARAMS];
+    int lengths[DB_MAX_PARAMS];
+    int formats[DB_MAX_PARAMS];
+    u8 binary[DB_MAX_PARAMS][4];
+} DbQuery;
+
+/* A DbBatch collects upserts per table and writes each table's rows with a single statement that unnests one array
+ * parameter per column. Rows sharing a key are merged while they wait, the later one wins, except that an optional
+ * field arriving empty keeps the earlier value, just as the row-by-row upsert would. */
+typedef struct DbBatch DbBatch;
+
+typedef enum {
+    DB_OK = 0,
+    DB_QUERY_FAILED,
+    DB_CONNECTION_LOST,
+} DbStatus;
+
 PGconn* connect_db(char* db_url);
 
-void upsert_chats(PGconn* client, Chat* chat);
+void build_chat_upsert(DbQuery* query, const Chat* chat);
+
+void build_message_upsert(DbQuery* query, const Message* message);
+
+void build_customer_upsert(DbQuery* query, const Customer* customer);
+
+bool db_send_query(PGconn* client, const DbQuery* query);
+
+bool db_report_result(PGresult* res);
+
+DbStatus db_command(PGconn* client, const char* sql);
+
+DbBatch* db_batch_new(i32 capacity);
+
+void db_batch_reset(DbBatch* batch);
+
+void db_batch_free(DbBatch* batch);
+
+/* Distinct rows waiting across all tables. */
+i32 db_batch_rows(const DbBatch* batch);
+
+/* Every String is copied into the batch. Returns false when the table already holds capacity distinct rows. */
+bool db_batch_add_chat(DbBatch* batch, const Chat* chat);
+
+bool db_batch_add_message(DbBatch* batch, const Message* message);
+
+bool db_batch_add_customer(DbBatch* batch, const Customer* customer);
+
+/* Writes every table in one transaction and resets the batch either way. A bulk flush streams the rows with a binary
+ * COPY into the connection's staging tables and merges them from there, which is cheaper for large batches. The first
+ * bulk flush on a connection creates its staging tables. */
+DbStatus db_batch_flush(PGconn* client, DbBatch* batch, bool bulk);
+
+DbStatus upsert_chats(PGconn* client, Chat* chat);
 
-void upsert_messages(PGconn* client, Message* message);
+DbStatus upsert_messages(PGconn* client, Message* message);
 
-void upsert_customer(PGconn* client, Customer* customer);
\ No newline at end of file
+DbStatus upsert_customer(PGconn* client, Customer* customer);
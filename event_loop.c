@@ -0,0 +1,740 @@
+#include "event_loop.h"
+#include <sys/epoll.h>
+#include <rabbitmq-c/amqp.h>
+#include <curl/curl.h>
+#include "rabbit.h"
+#include "database.h"
+#include "redis.h"
+#include "process.h"
+#include "api.h"
+#include "worker.h"
+#include "reconnect.h"
+
+#define LOOP_MAX_EVENTS 64
+#define LOOP_POLL_MS 1000
+#define SLOT_ARENA_SIZE (64 * 1024)
+
+typedef enum {
+    SOURCE_AMQP = 1,
+    SOURCE_DB,
+    SOURCE_REDIS,
+    SOURCE_CURL,
+    SOURCE_PUBLISHER,
+} SourceKind;
+
+/* Epoll events carry kind and fd by value instead of a pointer, curl may drop a socket's Source
+ * while events for it are still pending in the same epoll_wait batch. */
+#define SOURCE_EVENT_DATA(kind, fd) (((u64)(kind) << 32) | (u32)(fd))
+#define SOURCE_EVENT_KIND(data) ((SourceKind)((data) >> 32))
+#define SOURCE_EVENT_FD(data) ((int)(u32)(data))
+
+typedef struct {
+    SourceKind kind;
+    int fd;
+    u32 events;
+} Source;
+
+typedef struct InFlight InFlight;
+
+/* One HTTP request of a delivery, curl hands it back on completion, an envelope can have several in flight. */
+typedef struct {
+    InFlight* slot;
+    i32 operation;
+    PreparedRequest prepared;
+} SlotRequest;
+
+/* One delivery between being read from AMQP and being acknowledged. Its DB writes run one after the other on the
+ * loop's connection, wrapped in BEGIN and COMMIT when an envelope has more than one, and its HTTP requests only start
+ * once those writes are committed. In pipeline mode its writes are instead queued right behind the previous
+ * delivery's and closed with a sync point, which makes them one implicit transaction. */
+struct InFlight {
+    u64 delivery_tag;
+    bool done;
+    /* Handed back with basic.nack, so a later basic.ack multiple=true must not name it. */
+    bool requeued;
+    ProcessStatus status;
+    Delivery delivery;
+    Arena* arena;
+    OutgoingBatch batch;
+    DbQuery* queries;
+    i32 query_count;
+    i32 query_next;
+    bool transaction;
+    SlotRequest* requests;
+    i32 request_count;
+    i32 requests_pending;
+    InFlight* next;
+};
+
+typedef struct {
+    Dotenv* env;
+    int epfd;
+    bool failed;
+
+    amqp_connection_state_t rabbit;
+    Publisher publisher;
+    /* The publisher connection publisher_source belongs to, a new one needs its socket watched. */
+    amqp_connection_state_t publisher_conn;
+    PGconn* db;
+    redisAsyncContext* redis;
+    CURLM* curl;
+    i64 curl_deadline_ms;
+
+    Source amqp_source;
+    Source db_source;
+    Source redis_source;
+    Source publisher_source;
+
+    /* Slots form a ring in delivery order, so completions can be acknowledged with multiple=true. */
+    InFlight* slots;
+    i32 capacity;
+    i32 head;
+    i32 count;
+    AckWindow acks;
+
+    /* Without pipeline mode a libpq connection runs one query at a time, the rest wait here. */
+    InFlight* db_queue_head;
+    InFlight* db_queue_tail;
+    InFlight* db_active;
+
+    /* With DB_PIPELINE every delivery's writes are sent at once, the slots wait here for their results in order. */
+    bool pipeline;
+    InFlight* pipeline_head;
+    InFlight* pipeline_tail;
+} EventLoop;
+
+static void source_watch(EventLoop* loop, Source* source, u32 events) {
+    if (source->events == events) return;
+    struct epoll_event event = { .events = events, .data.u64 = SOURCE_EVENT_DATA(source->kind, source->fd) };
+    int op = EPOLL_CTL_MOD;
+    if (source->events == 0) op = EPOLL_CTL_ADD;
+    else if (events == 0) op = EPOLL_CTL_DEL;
+    if (epoll_ctl(loop->epfd, op, source->fd, &event) != 0 && op != EPOLL_CTL_DEL) {
+        LogError("EventLoop: epoll_ctl failed for fd %d: %s", source->fd, strerror(errno));
+        return;
+    }
+    source->events = events;
+}
+
+static void log_completed(const OutgoingBatch* batch) {
+    if (batch->count > 1) {
+        LogSuccess("Envelope of %d operations completed.", batch->count);
+        return;
+    }
+    switch (batch->operations[0].action) {
+        case OUTGOING_UPSERT_CHAT: LogSuccess("UpsertChat process completed."); break;
+        case OUTGOING_UPSERT_CUSTOMER: LogSuccess("UpsertCustomer process completed."); break;
+        case OUTGOING_SEND_MESSAGE: LogSuccess("UpsertMessage process completed."); break;
+        case OUTGOING_SEND_REQUEST: LogSuccess("SendRequest process completed."); break;
+        case OUTGOING_UNKNOWN: break;
+    }
+}
+
+/* ====== [IN-FLIGHT SLOTS] ====== */
+
+static InFlight* slot_acquire(EventLoop* loop, u64 delivery_tag) {
+    if (loop->count == loop->capacity) return nullptr;
+    InFlight* slot = &loop->slots[(loop->head + loop->count) % loop->capacity];
+    loop->count++;
+    slot->delivery_tag = delivery_tag;
+    slot->done = false;
+    slot->requeued = false;
+    slot->status = PROCESS_OK;
+    slot->batch = (OutgoingBatch){0};
+    slot->query_count = slot->query_next = 0;
+    slot->transaction = false;
+    slot->request_count = slot->requests_pending = 0;
+    slot->next = nullptr;
+    return slot;
+}
+
+static void slot_complete(EventLoop* loop, InFlight* slot) {
+    slot->done = true;
+    while (loop->count > 0 && loop->slots[loop->head].done) {
+        if (!loop->slots[loop->head].requeued) ack_window_track(&loop->acks, loop->slots[loop->head].delivery_tag);
+        loop->head = (loop->head + 1) % loop->capacity;
+        loop->count--;
+    }
+}
+
+/* One the broker didn't take is requeued instead and left out of the acknowledgements, if even that fails the AMQP
+ * connection is gone and the broker redelivers it after the restart. */
+static void slot_requeue(EventLoop* loop, InFlight* slot) {
+    if (!requeue_delivery(loop->rabbit, slot->delivery_tag)) {
+        loop->failed = true;
+        return;
+    }
+    slot->requeued = true;
+    slot_complete(loop, slot);
+}
+
+/* A dropped publisher connection closed its socket, which already took it out of the epoll set. */
+static void publisher_watch(EventLoop* loop) {
+    if (loop->publisher_conn == loop->publisher.conn) return;
+    loop->publisher_conn = loop->publisher.conn;
+    loop->publisher_source = (Source){ .kind = SOURCE_PUBLISHER, .fd = publisher_fd(&loop->publisher) };
+    if (loop->publisher_conn) source_watch(loop, &loop->publisher_source, EPOLLIN);
+}
+
+/* A failed delivery is republished for a delayed retry or dead-lettered right away, it only counts as done once
+ * publisher_drain saw the broker confirm the copy. */
+static void slot_finish(EventLoop* loop, InFlight* slot, ProcessStatus status) {
+    if (status == PROCESS_OK) {
+        log_completed(&slot->batch);
+        slot_complete(loop, slot);
+    } else if (reject_delivery(&loop->publisher, loop->env->outgoing_queue.data, &slot->delivery, status == PROCESS_FAILED,
+                               slot->batch.requests_done, slot->arena)) {
+        publisher_watch(loop);
+    } else {
+        publisher_watch(loop);
+        slot_requeue(loop, slot);
+    }
+}
+
+/* Like amqp_drain, librabbitmq may already hold confirms in its buffers, so they are read until none are left. */
+static void publisher_drain(EventLoop* loop) {
+    const struct timeval zero = { 0 };
+    PublishConfirm confirm;
+    while (!loop->failed && publisher_next_confirm(&loop->publisher, &zero, &confirm)) {
+        InFlight* slot = nullptr;
+        for (i32 i = 0; i < loop->count && !slot; i++) {
+            InFlight* candidate = &loop->slots[(loop->head + i) % loop->capacity];
+            if (!candidate->done && candidate->delivery_tag == confirm.delivery_tag) slot = candidate;
+        }
+        if (!slot) continue;
+        if (confirm.state == PUBLISH_CONFIRMED) slot_complete(loop, slot);
+        else slot_requeue(loop, slot);
+    }
+    publisher_watch(loop);
+}
+
+/* ====== [POSTGRES] ====== */
+
+static void db_watch(EventLoop* loop) {
+    const bool unflushed = (loop->db_active || loop->pipeline_head) && PQflush(loop->db) == 1;
+    source_watch(loop, &loop->db_source, EPOLLIN | (unflushed ? EPOLLOUT : 0));
+}
+
+static void start_requests(EventLoop* loop, InFlight* slot);
+
+/* After a failure inside a transaction only the closing COMMIT is still sent, which Postgres turns into a ROLLBACK.
+ * Returns whether a query of the slot is now running. */
+static bool db_send_next(EventLoop* loop, InFlight* slot) {
+    while (slot->query_next < slot->query_count) {
+        if (slot->status != PROCESS_OK) {
+            if (!slot->transaction) return false;
+            slot->query_next = Max(slot->query_next, slot->query_count - 1);
+        }
+        if (db_send_query(loop->db, &slot->queries[slot->query_next++])) return true;
+        if (PQstatus(loop->db) != CONNECTION_OK) {
+            /* Left unacknowledged, the delivery comes back once the loop has reconnected. */
+            loop->failed = true;
+            return false;
+        }
+        slot->status = PROCESS_FAILED;
+    }
+    return false;
+}
+
+static void db_finished(EventLoop* loop, InFlight* slot) {
+    if (slot->status != PROCESS_OK) slot_finish(loop, slot, slot->status);
+    else start_requests(loop, slot);
+}
+
+static void db_pump(EventLoop* loop) {
+    while (!loop->db_active && loop->db_queue_head) {
+        InFlight* slot = loop->db_queue_head;
+        loop->db_queue_head = slot->next;
+        if (!loop->db_queue_head) loop->db_queue_tail = nullptr;
+        if (db_send_next(loop, slot)) {
+            loop->db_active = slot;
+            break;
+        }
+        if (loop->failed) return;
+        db_finished(loop, slot);
+        if (loop->failed) return;
+    }
+    db_watch(loop);
+}
+
+/* A query libpq refuses to queue means the connection is gone, whatever is in the pipeline is redelivered once the
+ * loop has reconnected. */
+static void db_pipeline_send(EventLoop* loop, InFlight* slot) {
+    for (i32 i = 0; i < slot->query_count; i++) {
+        if (!db_send_query(loop->db, &slot->queries[i])) {
+            loop->failed = true;
+            return;
+        }
+    }
+    if (!PQpipelineSync(loop->db)) {
+        LogError("EventLoop: Pipeline sync failed: %s", PQerrorMessage(loop->db));
+        loop->failed = true;
+        return;
+    }
+    if (loop->pipeline_tail) loop->pipeline_tail->next = slot;
+    else loop->pipeline_head = slot;
+    loop->pipeline_tail = slot;
+    db_watch(loop);
+}
+
+/* Results come back in the order the queries were sent, each slot's end at its sync point. Once one of its queries
+ * failed Postgres skips the rest of the slot's queries and rolls the slot back. */
+static void db_pipeline_results(EventLoop* loop) {
+    while (loop->pipeline_head && !PQisBusy(loop->db)) {
+        PGresult* res = PQgetResult(loop->db);
+        if (!res) continue;
+        InFlight* slot = loop->pipeline_head;
+        const ExecStatusType status = PQresultStatus(res);
+        if (status == PGRES_PIPELINE_SYNC) {
+            PQclear(res);
+            loop->pipeline_head = slot->next;
+            if (!loop->pipeline_head) loop->pipeline_tail = nullptr;
+            db_finished(loop, slot);
+            if (loop->failed) return;
+            continue;
+        }
+        if (status == PGRES_PIPELINE_ABORTED) slot->status = PROCESS_FAILED;
+        else if (!db_report_result(res)) slot->status = PROCESS_FAILED;
+        PQclear(res);
+    }
+    db_watch(loop);
+}
+
+static void db_enqueue(EventLoop* loop, InFlight* slot) {
+    if (loop->pipeline) {
+        db_pipeline_send(loop, slot);
+        return;
+    }
+    if (loop->db_queue_tail) loop->db_queue_tail->next = slot;
+    else loop->db_queue_head = slot;
+    loop->db_queue_tail = slot;
+    db_pump(loop);
+}
+
+static void db_on_event(EventLoop* loop, u32 events) {
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        if (!PQconsumeInput(loop->db)) {
+            LogError("EventLoop: Lost the DB connection: %s", PQerrorMessage(loop->db));
+            loop->failed = true;
+            return;
+        }
+    }
+    if (loop->pipeline) {
+        db_pipeline_results(loop);
+        return;
+    }
+    while (loop->db_active && !PQisBusy(loop->db)) {
+        PGresult* res = PQgetResult(loop->db);
+        if (!res) {
+            InFlight* slot = loop->db_active;
+            if (db_send_next(loop, slot)) continue;
+            loop->db_active = nullptr;
+            if (loop->failed) return;
+            db_finished(loop, slot);
+            break;
+        }
+        if (!db_report_result(res)) loop->db_active->status = PROCESS_FAILED;
+        PQclear(res);
+    }
+    if (loop->failed) return;
+    db_pump(loop);
+}
+
+/* ====== [REDIS] ====== */
+
+static void redis_add_read(void* data) {
+    EventLoop* loop = data;
+    source_watch(loop, &loop->redis_source, loop->redis_source.events | EPOLLIN);
+}
+
+static void redis_del_read(void* data) {
+    EventLoop* loop = data;
+    source_watch(loop, &loop->redis_source, loop->redis_source.events & ~(u32)EPOLLIN);
+}
+
+static void redis_add_write(void* data) {
+    EventLoop* loop = data;
+    source_watch(loop, &loop->redis_source, loop->redis_source.events | EPOLLOUT);
+}
+
+static void redis_del_write(void* data) {
+    EventLoop* loop = data;
+    source_watch(loop, &loop->redis_source, loop->redis_source.events & ~(u32)EPOLLOUT);
+}
+
+static void redis_cleanup(void* data) {
+    EventLoop* loop = data;
+    source_watch(loop, &loop->redis_source, 0);
+}
+
+static void redis_on_disconnect(const redisAsyncContext* ac, int status) {
+    EventLoop* loop = ac->ev.data;
+    if (status != REDIS_OK) {
+        LogError("EventLoop: Redis disconnected: %s", ac->errstr);
+        loop->failed = true;
+    }
+    loop->redis = nullptr;
+}
+
+static void redis_attach(EventLoop* loop, redisAsyncContext* ac) {
+    loop->redis_source = (Source){ .kind = SOURCE_REDIS, .fd = ac->c.fd };
+    ac->ev.data = loop;
+    ac->ev.addRead = redis_add_read;
+    ac->ev.delRead = redis_del_read;
+    ac->ev.addWrite = redis_add_write;
+    ac->ev.delWrite = redis_del_write;
+    ac->ev.cleanup = redis_cleanup;
+    redisAsyncSetDisconnectCallback(ac, redis_on_disconnect);
+}
+
+/* ====== [CURL] ====== */
+
+static int curl_socket_changed(CURL* easy, curl_socket_t fd, int what, void* userp, void* socketp) {
+    (void)easy;
+    EventLoop* loop = userp;
+    Source* source = socketp;
+    if (what == CURL_POLL_REMOVE) {
+        if (source) {
+            source_watch(loop, source, 0);
+            Free(source);
+        }
+        return 0;
+    }
+    if (!source) {
+        source = Malloc(sizeof(Source));
+        *source = (Source){ .kind = SOURCE_CURL, .fd = fd };
+        curl_multi_assign(loop->curl, fd, source);
+    }
+    u32 events = 0;
+    if (what & CURL_POLL_IN) events |= EPOLLIN;
+    if (what & CURL_POLL_OUT) events |= EPOLLOUT;
+    source_watch(loop, source, events);
+    return 0;
+}
+
+static int curl_timer_changed(CURLM* multi, long timeout_ms, void* userp) {
+    (void)multi;
+    EventLoop* loop = userp;
+    loop->curl_deadline_ms = timeout_ms < 0 ? -1 : TimeNow() + timeout_ms;
+    return 0;
+}
+
+static void curl_check_done(EventLoop* loop) {
+    CURLMsg* msg;
+    int left;
+    while ((msg = curl_multi_info_read(loop->curl, &left))) {
+        if (msg->msg != CURLMSG_DONE) continue;
+        void* private = nullptr;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &private);
+        SlotRequest* request = private;
+        InFlight* slot = request->slot;
+        const CURLcode result = msg->data.result;
+        curl_multi_remove_handle(loop->curl, msg->easy_handle);
+        if (result != CURLE_OK) {
+            LogError("curl request failed: %s", curl_easy_strerror(result));
+            slot->status = PROCESS_FAILED;
+        } else {
+            outgoing_mark_request_done(&slot->batch, request->operation);
+        }
+        release_request(&request->prepared);
+        if (--slot->requests_pending == 0) slot_finish(loop, slot, slot->status);
+        if (loop->failed) return;
+    }
+}
+
+static void curl_on_event(EventLoop* loop, int fd, u32 events) {
+    int flags = 0;
+    if (events & EPOLLIN) flags |= CURL_CSELECT_IN;
+    if (events & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+    if (events & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+    int running;
+    curl_multi_socket_action(loop->curl, fd, flags, &running);
+    curl_check_done(loop);
+}
+
+/* ====== [AMQP] ====== */
+
+/* Requests that went out on an earlier attempt of the delivery are skipped. */
+static bool request_pending(const OutgoingBatch* batch, i32 index) {
+    return batch->operations[index].action == OUTGOING_SEND_REQUEST && !outgoing_request_done(batch, index);
+}
+
+static void start_requests(EventLoop* loop, InFlight* slot) {
+    for (i32 i = 0; i < slot->batch.count; i++) {
+        if (request_pending(&slot->batch, i)) slot->request_count++;
+    }
+    if (slot->request_count == 0) {
+        slot_finish(loop, slot, slot->status);
+        return;
+    }
+    slot->requests = ArenaAlloc(slot->arena, sizeof(SlotRequest) * slot->request_count);
+    i32 r = 0;
+    for (i32 i = 0; i < slot->batch.count; i++) {
+        OutgoingOperation* operation = &slot->batch.operations[i];
+        if (!request_pending(&slot->batch, i)) continue;
+        SlotRequest* request = &slot->requests[r++];
+        request->slot = slot;
+        request->operation = i;
+        if (!prepare_request(&operation->request, slot->arena, &request->prepared)) {
+            slot->status = PROCESS_FAILED;
+            continue;
+        }
+        curl_easy_setopt(request->prepared.curl, CURLOPT_PRIVATE, request);
+        curl_multi_add_handle(loop->curl, request->prepared.curl);
+        slot->requests_pending++;
+    }
+    if (slot->requests_pending == 0) slot_finish(loop, slot, slot->status);
+}
+
+static void dispatch(EventLoop* loop, InFlight* slot) {
+    i32 writes = 0;
+    for (i32 i = 0; i < slot->batch.count; i++) {
+        if (slot->batch.operations[i].action != OUTGOING_SEND_REQUEST) writes++;
+    }
+    if (writes == 0) {
+        start_requests(loop, slot);
+        return;
+    }
+    slot->transaction = writes > 1 && !loop->pipeline;
+    slot->queries = ArenaAlloc(slot->arena, sizeof(DbQuery) * (writes + (slot->transaction ? 2 : 0)));
+    if (slot->transaction) slot->queries[slot->query_count++] = (DbQuery){ .sql = "BEGIN" };
+    for (i32 i = 0; i < slot->batch.count; i++) {
+        const OutgoingOperation* operation = &slot->batch.operations[i];
+        DbQuery* query = &slot->queries[slot->query_count];
+        switch (operation->action) {
+            case OUTGOING_UPSERT_CHAT: build_chat_upsert(query, &operation->chat); break;
+            case OUTGOING_UPSERT_CUSTOMER: build_customer_upsert(query, &operation->customer); break;
+            case OUTGOING_SEND_MESSAGE: build_message_upsert(query, &operation->message); break;
+            case OUTGOING_SEND_REQUEST:
+            case OUTGOING_UNKNOWN:
+                continue;
+        }
+        slot->query_count++;
+    }
+    if (slot->transaction) slot->queries[slot->query_count++] = (DbQuery){ .sql = "COMMIT" };
+    db_enqueue(loop, slot);
+}
+
+static void amqp_fail(EventLoop* loop) {
+    drop_rabbitmq(loop->rabbit);
+    loop->rabbit = nullptr;
+    loop->failed = true;
+}
+
+/* With every slot busy the broker has PREFETCH_COUNT deliveries unacknowledged and sends no more, but the connection
+ * still has to exchange heartbeats. A zero-timeout frame wait sends ours when due and swallows the broker's, any other
+ * frame means the channel is going away. */
+static void amqp_service(EventLoop* loop) {
+    const struct timeval zero = { 0 };
+    amqp_frame_t frame;
+    amqp_maybe_release_buffers(loop->rabbit);
+    const int status = amqp_simple_wait_frame_noblock(loop->rabbit, &frame, &zero);
+    if (status == AMQP_STATUS_TIMEOUT) return;
+    if (status == AMQP_STATUS_OK) LogError("EventLoop: Unexpected frame of type %d while every slot is busy.", frame.frame_type);
+    else LogError("EventLoop: Consume failed: %s", amqp_error_string2(status));
+    amqp_fail(loop);
+}
+
+/* librabbitmq buffers frames internally, so the socket is drained until it reports a timeout
+ * instead of trusting epoll to report data that already left the kernel. The delivery is detached into
+ * the slot Arena before the next read releases the frame buffers it may point into, a failure may still republish it. */
+static void amqp_drain(EventLoop* loop) {
+    const struct timeval zero = { 0 };
+    while (loop->count < loop->capacity) {
+        /* The slot Arena is only claimed once a delivery has actually arrived, so read into a scratch slot first. */
+        InFlight* slot = &loop->slots[(loop->head + loop->count) % loop->capacity];
+        if (!slot->arena) slot->arena = ArenaCreate(SLOT_ARENA_SIZE);
+        ArenaReset(slot->arena);
+
+        Delivery delivery;
+        amqp_maybe_release_buffers(loop->rabbit);
+        const int status = read_delivery(loop->rabbit, slot->arena, &delivery, &zero);
+        if (status == AMQP_STATUS_TIMEOUT) {
+            break;
+        }
+        if (status != AMQP_STATUS_OK) {
+            LogError("EventLoop: Consume failed: %s", amqp_error_string2(status));
+            amqp_fail(loop);
+            return;
+        }
+
+        slot = slot_acquire(loop, delivery.delivery_tag);
+        detach_delivery(&delivery, slot->arena);
+        slot->delivery = delivery;
+        if (!decode_outgoing(delivery.body, payload_format(delivery_content_type(&delivery)), slot->arena, &slot->batch)) {
+            slot_finish(loop, slot, PROCESS_INVALID);
+        } else {
+            slot->batch.requests_done = delivery_requests_done(&delivery);
+            dispatch(loop, slot);
+        }
+        if (loop->failed) return;
+    }
+    if (loop->count == loop->capacity) amqp_service(loop);
+}
+
+/* ====== [LOOP] ====== */
+
+static bool event_loop_open(EventLoop* loop, Dotenv* env, Arena* arena) {
+    *loop = (EventLoop){ .env = env, .curl_deadline_ms = -1, .publisher = publisher_new(env) };
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        LogError("EventLoop: Couldn't create epoll instance: %s", strerror(errno));
+        return false;
+    }
+
+    loop->rabbit = create_rabbitmq_consumer(env, env->outgoing_queue.data);
+    if (loop->rabbit && !declare_retry_queues(loop->rabbit, env, env->outgoing_queue.data)) {
+        drop_rabbitmq(loop->rabbit);
+        loop->rabbit = nullptr;
+    }
+    loop->db = connect_db(env->db_url.data);
+    loop->redis = connectRedisAsync(env->redis_url, arena);
+    loop->curl = curl_multi_init();
+    if (!loop->rabbit || !loop->db || !loop->redis || !loop->curl) {
+        LogError("EventLoop: Couldn't open its connections.");
+        return false;
+    }
+
+    loop->amqp_source = (Source){ .kind = SOURCE_AMQP, .fd = amqp_get_sockfd(loop->rabbit) };
+    source_watch(loop, &loop->amqp_source, EPOLLIN);
+
+    PQsetnonblocking(loop->db, 1);
+    if (env->db_pipeline) {
+        if (!PQenterPipelineMode(loop->db)) {
+            LogError("EventLoop: Couldn't enter pipeline mode: %s", PQerrorMessage(loop->db));
+            return false;
+        }
+        loop->pipeline = true;
+    }
+    loop->db_source = (Source){ .kind = SOURCE_DB, .fd = PQsocket(loop->db) };
+    source_watch(loop, &loop->db_source, EPOLLIN);
+
+    redis_attach(loop, loop->redis);
+    authRedisAsync(loop->redis, env->redis_url, arena);
+
+    curl_multi_setopt(loop->curl, CURLMOPT_SOCKETFUNCTION, curl_socket_changed);
+    curl_multi_setopt(loop->curl, CURLMOPT_SOCKETDATA, loop);
+    curl_multi_setopt(loop->curl, CURLMOPT_TIMERFUNCTION, curl_timer_changed);
+    curl_multi_setopt(loop->curl, CURLMOPT_TIMERDATA, loop);
+
+    loop->capacity = env->prefetch_count;
+    loop->slots = Malloc(sizeof(InFlight) * loop->capacity);
+    memset(loop->slots, 0, sizeof(InFlight) * loop->capacity);
+    loop->acks = ack_window_new(loop->rabbit, env->ack_batch);
+    return true;
+}
+
+/* Completed deliveries are still acknowledged, anything else in flight is abandoned and redelivered by the broker. */
+static void event_loop_close(EventLoop* loop) {
+    if (loop->rabbit) ack_window_flush(&loop->acks);
+    close_rabbitmq(loop->rabbit);
+    publisher_close(&loop->publisher);
+    ack_window_free(&loop->acks);
+    if (loop->db) PQfinish(loop->db);
+    if (loop->redis) redisAsyncFree(loop->redis);
+    for (i32 i = 0; i < loop->count; i++) {
+        InFlight* slot = &loop->slots[(loop->head + i) % loop->capacity];
+        if (slot->done) continue;
+        for (i32 r = 0; r < slot->request_count; r++) {
+            PreparedRequest* prepared = &slot->requests[r].prepared;
+            if (!prepared->curl) continue;
+            curl_multi_remove_handle(loop->curl, prepared->curl);
+            release_request(prepared);
+        }
+    }
+    if (loop->curl) curl_multi_cleanup(loop->curl);
+    if (loop->slots) {
+        for (i32 i = 0; i < loop->capacity; i++) {
+            if (loop->slots[i].arena) ArenaFree(loop->slots[i].arena);
+        }
+        Free(loop->slots);
+    }
+    if (loop->epfd >= 0) close(loop->epfd);
+}
+
+static int next_timeout_ms(const EventLoop* loop) {
+    i64 timeout = LOOP_POLL_MS;
+    const i64 ack_due = ack_window_due_in(&loop->acks, loop->env->ack_interval_ms);
+    if (ack_due >= 0) timeout = Min(timeout, ack_due);
+    const i64 confirm_due = publisher_due_in(&loop->publisher);
+    if (confirm_due >= 0) timeout = Min(timeout, confirm_due);
+    if (loop->curl_deadline_ms >= 0) timeout = Min(timeout, Max(loop->curl_deadline_ms - TimeNow(), 0));
+    return (int)timeout;
+}
+
+static void event_loop_run(EventLoop* loop) {
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    while (!loop->failed) {
+        const bool stopping = workers_should_stop();
+        if (stopping) {
+            source_watch(loop, &loop->amqp_source, 0);
+            if (loop->count == 0) break;
+        } else if (loop->count == loop->capacity) {
+            /* The socket stays watched while full, this covers heartbeats that are due without anything to read. */
+            amqp_service(loop);
+            if (loop->failed) break;
+        }
+
+        const int ready = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, next_timeout_ms(loop));
+        if (ready < 0 && errno != EINTR) {
+            LogError("EventLoop: epoll_wait failed: %s", strerror(errno));
+            loop->failed = true;
+            break;
+        }
+        for (int i = 0; i < ready && !loop->failed; i++) {
+            const u64 data = events[i].data.u64;
+            switch (SOURCE_EVENT_KIND(data)) {
+                case SOURCE_AMQP:
+                    if (!stopping) amqp_drain(loop);
+                    break;
+                case SOURCE_DB:
+                    db_on_event(loop, events[i].events);
+                    break;
+                case SOURCE_REDIS:
+                    if (!loop->redis) break;
+                    if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) redisAsyncHandleRead(loop->redis);
+                    if (loop->redis && (events[i].events & EPOLLOUT)) redisAsyncHandleWrite(loop->redis);
+                    break;
+                case SOURCE_CURL:
+                    curl_on_event(loop, SOURCE_EVENT_FD(data), events[i].events);
+                    break;
+                case SOURCE_PUBLISHER:
+                    publisher_drain(loop);
+                    break;
+            }
+        }
+        /* Covers republishes whose confirm is overdue, publisher_next_confirm gives them up. */
+        if (!loop->failed && publisher_due_in(&loop->publisher) == 0) publisher_drain(loop);
+
+        if (loop->curl_deadline_ms >= 0 && TimeNow() >= loop->curl_deadline_ms) {
+            int running;
+            loop->curl_deadline_ms = -1;
+            curl_multi_socket_action(loop->curl, CURL_SOCKET_TIMEOUT, 0, &running);
+            curl_check_done(loop);
+        }
+        if (!loop->failed && ack_window_due_in(&loop->acks, loop->env->ack_interval_ms) == 0 && !ack_window_flush(&loop->acks)) {
+            amqp_fail(loop);
+        }
+    }
+}
+
+/* Any backend failure tears the whole loop down and opens it again with backoff, the broker redelivers
+ * whatever was still in flight once the old AMQP connection is gone. */
+void run_event_loop(Dotenv* env) {
+    Arena* arena = ArenaCreate(1024 * 1024);
+    Backoff backoff = backoff_new(env->reconnect_base_ms, env->reconnect_max_ms);
+    while (!workers_should_stop()) {
+        EventLoop loop;
+        if (event_loop_open(&loop, env, arena)) {
+            backoff_reset(&backoff);
+            LogSuccess("EventLoop: Consuming from '%s' with up to %d deliveries in flight", env->outgoing_queue.data, loop.capacity);
+            event_loop_run(&loop);
+        }
+        event_loop_close(&loop);
+        ArenaReset(arena);
+        if (workers_should_stop()) break;
+        if (!backoff_wait(&backoff, "EventLoop")) break;
+    }
+    ArenaFree(arena);
+    LogInfo("EventLoop: Stopped.");
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include "config.h"
+
+/* The event loop is the single-threaded alternative to the worker pool: one epoll set multiplexes the AMQP socket,
+ * a nonblocking libpq connection, a hiredis async context and a curl multi handle, so up to PREFETCH_COUNT
+ * deliveries can be waiting on different backends at the same time. */
+
+void run_event_loop(Dotenv* env);
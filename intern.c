@@ -0,0 +1,104 @@
+#include "intern.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define INTERN_ARENA_SIZE (64 * 1024)
+
+/* Lookups never lock: a slot is published with release ordering only after the symbol it points to is written, so a
+ * reader that sees a code also sees its string. A miss is retried under the lock before inserting. Open addressing at
+ * no more than half full, probes stay short. */
+static _Atomic u16* slots;
+static u32 slot_mask;
+static String* symbols;
+static u32 symbol_capacity;
+static u32 symbol_count;
+static Arena* symbol_arena;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Values every deployment sends, they are interned from static storage up front. */
+static const char* const known_symbols[] = {
+    "GET", "POST", "PUT", "PATCH", "DELETE", "HEAD", "OPTIONS",
+    "upsertChat", "upsertCustomer", "sendMessage", "sendRequest",
+    "enqueued",
+};
+
+static u32 hash_value(String value) {
+    u32 hash = 2166136261u;
+    for (size_t i = 0; i < value.length; i++) {
+        hash = (hash ^ (u8)value.data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static Symbol lookup(String value, u32 hash, u32* free_slot) {
+    for (u32 i = hash & slot_mask;; i = (i + 1) & slot_mask) {
+        const Symbol code = atomic_load_explicit(&slots[i], memory_order_acquire);
+        if (code == 0) {
+            *free_slot = i;
+            return 0;
+        }
+        if (StrEq(symbols[code], value)) return code;
+    }
+}
+
+/* Called with intern_lock held. */
+static Symbol insert(String canonical, u32 hash) {
+    u32 free_slot;
+    const Symbol existing = lookup(canonical, hash, &free_slot);
+    if (existing) return existing;
+    if (symbol_count == symbol_capacity) return 0;
+    const Symbol code = (Symbol)++symbol_count;
+    symbols[code] = canonical;
+    atomic_store_explicit(&slots[free_slot], code, memory_order_release);
+    return code;
+}
+
+bool intern_init(i32 capacity) {
+    const i32 known = (i32)(sizeof(known_symbols) / sizeof(known_symbols[0]));
+    if (capacity < known || capacity >= U16_MAX) {
+        LogError("Intern: INTERN_MAX_SYMBOLS has to be between %d and %d, got %d.", known, U16_MAX - 1, capacity);
+        return false;
+    }
+    u32 slot_count = 1;
+    while (slot_count < (u32)capacity * 2) slot_count <<= 1;
+    slots = Malloc(sizeof(*slots) * slot_count);
+    for (u32 i = 0; i < slot_count; i++) atomic_init(&slots[i], 0);
+    slot_mask = slot_count - 1;
+    symbols = Malloc(sizeof(String) * (capacity + 1));
+    symbol_capacity = (u32)capacity;
+    symbol_arena = ArenaCreate(INTERN_ARENA_SIZE);
+    for (i32 i = 0; i < known; i++) {
+        const String value = { .length = strlen(known_symbols[i]), .data = (char*)known_symbols[i] };
+        insert(value, hash_value(value));
+    }
+    return true;
+}
+
+Symbol intern(String value) {
+    if (StrIsNull(value) || value.length == 0) return 0;
+    const u32 hash = hash_value(value);
+    u32 free_slot;
+    Symbol code = lookup(value, hash, &free_slot);
+    if (code) return code;
+
+    pthread_mutex_lock(&intern_lock);
+    code = lookup(value, hash, &free_slot);
+    if (!code && symbol_count < symbol_capacity) {
+        char* copy = ArenaAllocChars(symbol_arena, value.length + 1);
+        memcpy(copy, value.data, value.length);
+        copy[value.length] = '\0';
+        code = insert((String){ .length = value.length, .data = copy }, hash);
+    }
+    const bool full = !code;
+    pthread_mutex_unlock(&intern_lock);
+    if (full) {
+        LogError("Intern: More than INTERN_MAX_SYMBOLS=%u distinct values, refusing '%.*s'.", symbol_capacity,
+                 (int)value.length, value.data);
+    }
+    return code;
+}
+
+String symbol_string(Symbol symbol) {
+    if (symbol == 0 || symbol > symbol_capacity) return (String){0};
+    return symbols[symbol];
+}
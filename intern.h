@@ -0,0 +1,21 @@
+#pragma once
+#include "include/base.h"
+
+/* Low-cardinality strings like a chat's situation or a request's method are interned: every distinct value gets a
+ * small code once, and structs carry the code instead of their own copy. The canonical string behind a code is
+ * NUL-terminated and lives until exit, so it can be bound to libpq or logged as is. */
+
+/* 0 means the field was missing or empty. */
+typedef u16 Symbol;
+
+/* Sizes the table for capacity distinct values, INTERN_MAX_SYMBOLS in the .env. Once that many have been seen new ones
+ * are refused, a field that should be low-cardinality but isn't must not grow the table without bound. Has to run
+ * before any thread interns, false when capacity doesn't fit a Symbol. */
+bool intern_init(i32 capacity);
+
+/* Thread-safe. Known values never allocate, a value seen for the first time is copied once. Returns 0 for a missing
+ * or empty value and when the table is full. */
+Symbol intern(String value);
+
+/* The canonical string of a code, a null String for 0. */
+String symbol_string(Symbol symbol);
@@ -0,0 +1,502 @@
+#include "json.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JSON_X86 1
+#endif
+
+#define JSON_BLOCK 64
+
+/* Bit i of each mask describes byte i of a 64 byte block. */
+typedef struct {
+    u64 quote;
+    u64 backslash;
+    u64 structural;
+} BlockMasks;
+
+typedef void (*ClassifyBlock)(const u8* block, BlockMasks* masks);
+
+/* ====== [KERNELS] ====== */
+
+static void classify_scalar(const u8* block, BlockMasks* masks) {
+    *masks = (BlockMasks){0};
+    for (u32 i = 0; i < JSON_BLOCK; i++) {
+        const u64 bit = 1ULL << i;
+        switch (block[i]) {
+            case '"': masks->quote |= bit; break;
+            case '\\': masks->backslash |= bit; break;
+            case '{': case '}': case '[': case ']': case ':': case ',': masks->structural |= bit; break;
+            default: break;
+        }
+    }
+}
+
+#ifdef JSON_X86
+/* pcmpestrm matches every byte of a chunk against the whole structural set in one instruction. */
+__attribute__((target("sse4.2")))
+static void classify_sse42(const u8* block, BlockMasks* masks) {
+    const __m128i set = _mm_setr_epi8('{', '}', '[', ']', ':', ',', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    *masks = (BlockMasks){0};
+    for (u32 i = 0; i < JSON_BLOCK / 16; i++) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i*)(block + i * 16));
+        const u32 shift = i * 16;
+        masks->quote |= (u64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, quote)) << shift;
+        masks->backslash |= (u64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, backslash)) << shift;
+        const __m128i any = _mm_cmpestrm(set, 6, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK);
+        masks->structural |= (u64)(u16)_mm_cvtsi128_si32(any) << shift;
+    }
+}
+
+__attribute__((target("avx2")))
+static u32 structural_avx2(__m256i chunk) {
+    __m256i any = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('{'));
+    any = _mm256_or_si256(any, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('}')));
+    any = _mm256_or_si256(any, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('[')));
+    any = _mm256_or_si256(any, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(']')));
+    any = _mm256_or_si256(any, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(':')));
+    any = _mm256_or_si256(any, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(',')));
+    return (u32)_mm256_movemask_epi8(any);
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const u8* block, BlockMasks* masks) {
+    const __m256i lo = _mm256_loadu_si256((const __m256i*)block);
+    const __m256i hi = _mm256_loadu_si256((const __m256i*)(block + 32));
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    masks->quote = (u64)(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, quote)) |
+                   (u64)(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, quote)) << 32;
+    masks->backslash = (u64)(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, backslash)) |
+                       (u64)(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, backslash)) << 32;
+    masks->structural = (u64)structural_avx2(lo) | (u64)structural_avx2(hi) << 32;
+}
+#endif
+
+static ClassifyBlock classify_block = classify_scalar;
+static const char* kernel_name = "scalar";
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/* JSON_KERNEL=scalar|sse4.2|avx2 pins a kernel, which is how they are compared against each other. */
+static void select_kernel(void) {
+#ifdef JSON_X86
+    const char* forced = getenv("JSON_KERNEL");
+    __builtin_cpu_init();
+    const bool avx2 = __builtin_cpu_supports("avx2");
+    const bool sse42 = __builtin_cpu_supports("sse4.2");
+    if (forced && strcmp(forced, "scalar") == 0) return;
+    if (avx2 && (!forced || strcmp(forced, "avx2") == 0)) {
+        classify_block = classify_avx2;
+        kernel_name = "avx2";
+    } else if (sse42) {
+        classify_block = classify_sse42;
+        kernel_name = "sse4.2";
+    }
+#endif
+}
+
+const char* json_kernel_name(void) {
+    pthread_once(&kernel_once, select_kernel);
+    return kernel_name;
+}
+
+/* ====== [KERNELS] ====== */
+
+
+/* ====== [INDEX] ====== */
+
+/* Bit i is set when an odd number of quotes precede or sit at byte i, that is when byte i is inside a string. */
+static u64 prefix_xor(u64 bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+/* The characters escaped by a backslash, an odd run of backslashes escapes the character after it.
+ * prev_escaped carries a trailing escape over into the next block. */
+static u64 escaped_bits(u64 backslash, u64* prev_escaped) {
+    const u64 even_bits = 0x5555555555555555ULL;
+    backslash &= ~*prev_escaped;
+    const u64 follows_escape = backslash << 1 | *prev_escaped;
+    const u64 odd_sequence_starts = backslash & ~even_bits & ~follows_escape;
+    u64 sequences_starting_on_even_bits;
+    *prev_escaped = __builtin_add_overflow(odd_sequence_starts, backslash, &sequences_starting_on_even_bits);
+    const u64 invert_mask = sequences_starting_on_even_bits << 1;
+    return (even_bits ^ invert_mask) & follows_escape;
+}
+
+static bool is_whitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* Walks the structural entries once more: brackets have to nest and close in kind, and a comma needs a member on both
+ * sides. Scalars are still only checked when they are read. */
+static bool structure_valid(Arena* arena, const JsonDoc* doc) {
+    const char* data = doc->input.data;
+    char* open = ArenaAllocChars(arena, doc->count + 1);
+    u32 depth = 0;
+    for (u32 token = 0; token < doc->count; token++) {
+        const u32 offset = doc->index[token];
+        switch (data[offset]) {
+            case '"':
+                token++;
+                break;
+            case '{':
+            case '[':
+                open[depth++] = data[offset];
+                break;
+            case '}':
+            case ']':
+                if (depth == 0 || open[--depth] != (data[offset] == '}' ? '{' : '[')) return false;
+                break;
+            case ',': {
+                u32 before = offset;
+                while (before > 0 && is_whitespace(data[before - 1])) before--;
+                u32 after = offset + 1;
+                while (after < doc->input.length && is_whitespace(data[after])) after++;
+                if (depth == 0 || before == 0 || after == doc->input.length) return false;
+                const char prev = data[before - 1];
+                const char next = data[after];
+                if (prev == '{' || prev == '[' || prev == ',' || next == '}' || next == ']' || next == ',') return false;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return depth == 0;
+}
+
+bool json_index(Arena* arena, String input, JsonDoc* doc) {
+    *doc = (JsonDoc){ .input = input };
+    if (StrIsNull(input) || input.length == 0 || input.length >= U32_MAX) return false;
+    pthread_once(&kernel_once, select_kernel);
+
+    doc->index = ArenaAllocAligned(arena, sizeof(u32) * (input.length + 1), sizeof(u32));
+    const u8* data = (const u8*)input.data;
+    u8 tail[JSON_BLOCK];
+    u64 prev_escaped = 0;
+    u64 prev_in_string = 0;
+    u32 count = 0;
+    for (size_t base = 0; base < input.length; base += JSON_BLOCK) {
+        const u8* block = data + base;
+        if (input.length - base < JSON_BLOCK) {
+            memset(tail, ' ', JSON_BLOCK);
+            memcpy(tail, block, input.length - base);
+            block = tail;
+        }
+        BlockMasks masks;
+        classify_block(block, &masks);
+        const u64 quotes = masks.quote & ~escaped_bits(masks.backslash, &prev_escaped);
+        const u64 in_string = prefix_xor(quotes) ^ prev_in_string;
+        prev_in_string = (u64)((i64)in_string >> 63);
+
+        /* Every unescaped quote is kept, so a string is always two consecutive entries. */
+        u64 tokens = (masks.structural & ~in_string) | quotes;
+        while (tokens) {
+            doc->index[count++] = (u32)(base + __builtin_ctzll(tokens));
+            tokens &= tokens - 1;
+        }
+    }
+    doc->count = count;
+    return prev_in_string == 0 && structure_valid(arena, doc);
+}
+
+/* ====== [INDEX] ====== */
+
+
+/* ====== [NAVIGATION] ====== */
+
+static char token_char(const JsonDoc* doc, u32 token) {
+    return token < doc->count ? doc->input.data[doc->index[token]] : '\0';
+}
+
+static u32 skip_whitespace(const JsonDoc* doc, u32 offset) {
+    while (offset < doc->input.length && is_whitespace(doc->input.data[offset])) offset++;
+    return offset;
+}
+
+/* The value whose text starts at or after offset, token being the first index entry past offset. Strings and
+ * containers have to start exactly at that entry, scalars have no entry of their own. */
+static JsonValue value_at(const JsonDoc* doc, u32 token, u32 offset) {
+    offset = skip_whitespace(doc, offset);
+    if (offset >= doc->input.length) return (JsonValue){0};
+    const char c = doc->input.data[offset];
+    if ((c == '"' || c == '{' || c == '[') && (token >= doc->count || doc->index[token] != offset)) return (JsonValue){0};
+    return (JsonValue){ .doc = doc, .token = token, .offset = offset };
+}
+
+JsonValue json_root(const JsonDoc* doc) {
+    if (!doc->index) return (JsonValue){0};
+    return value_at(doc, 0, 0);
+}
+
+JsonType json_type(JsonValue value) {
+    if (!value.doc) return JSON_MISSING;
+    switch (value.doc->input.data[value.offset]) {
+        case '{': return JSON_OBJECT;
+        case '[': return JSON_ARRAY;
+        case '"': return JSON_STRING;
+        case 't': case 'f': return JSON_BOOL;
+        case 'n': return JSON_NULL;
+        case '-': case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9': return JSON_NUMBER;
+        default: return JSON_MISSING;
+    }
+}
+
+/* The first index entry after a value, a whole nested container is stepped over without decoding it.
+ * False when the container never closes. */
+static bool value_end_token(JsonValue value, u32* end) {
+    const JsonDoc* doc = value.doc;
+    switch (doc->input.data[value.offset]) {
+        case '"':
+            *end = value.token + 2;
+            return true;
+        case '{':
+        case '[': {
+            u32 depth = 0;
+            for (u32 token = value.token; token < doc->count; token++) {
+                const char c = doc->input.data[doc->index[token]];
+                if (c == '{' || c == '[') depth++;
+                else if ((c == '}' || c == ']') && --depth == 0) {
+                    *end = token + 1;
+                    return true;
+                }
+            }
+            return false;
+        }
+        default:
+            *end = value.token;
+            return true;
+    }
+}
+
+void json_fields(JsonValue object, const JsonKey* keys, u32 key_count, JsonValue* values) {
+    memset(values, 0, sizeof(JsonValue) * key_count);
+    if (json_type(object) != JSON_OBJECT) return;
+    const JsonDoc* doc = object.doc;
+    u32 remaining = key_count;
+    u32 token = object.token + 1;
+    while (remaining > 0 && token_char(doc, token) == '"' && token + 1 < doc->count) {
+        const char* key = doc->input.data + doc->index[token] + 1;
+        const u32 key_length = doc->index[token + 1] - doc->index[token] - 1;
+        token += 2;
+        if (token_char(doc, token) != ':') return;
+        const JsonValue value = value_at(doc, token + 1, doc->index[token] + 1);
+        if (!value.doc) return;
+        for (u32 k = 0; k < key_count; k++) {
+            if (!values[k].doc && keys[k].length == key_length && memcmp(keys[k].name, key, key_length) == 0) {
+                values[k] = value;
+                remaining--;
+                break;
+            }
+        }
+        if (!value_end_token(value, &token) || token_char(doc, token) != ',') return;
+        token++;
+    }
+}
+
+JsonValue json_field(JsonValue object, const char* key) {
+    const JsonKey lookup = { .name = key, .length = (u32)strlen(key) };
+    JsonValue value;
+    json_fields(object, &lookup, 1, &value);
+    return value;
+}
+
+JsonIter json_iter(JsonValue array) {
+    return (JsonIter){ .array = array, .next = array.token + 1, .done = json_type(array) != JSON_ARRAY };
+}
+
+bool json_iter_next(JsonIter* iter, JsonValue* element) {
+    if (iter->done) return false;
+    const JsonDoc* doc = iter->array.doc;
+    const JsonValue value = value_at(doc, iter->next, doc->index[iter->next - 1] + 1);
+    if (json_type(value) == JSON_MISSING) {
+        iter->done = true;
+        return false;
+    }
+    u32 end;
+    if (!value_end_token(value, &end)) {
+        iter->done = true;
+        return false;
+    }
+    if (token_char(doc, end) == ',') iter->next = end + 1;
+    else iter->done = true;
+    *element = value;
+    return true;
+}
+
+/* ====== [NAVIGATION] ====== */
+
+
+/* ====== [SCALARS] ====== */
+
+static i32 hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static i32 read_hex4(const char* p, const char* end) {
+    if (end - p < 4) return -1;
+    i32 code = 0;
+    for (i32 i = 0; i < 4; i++) {
+        const i32 digit = hex_digit(p[i]);
+        if (digit < 0) return -1;
+        code = code << 4 | digit;
+    }
+    return code;
+}
+
+static size_t write_utf8(char* out, u32 code) {
+    if (code < 0x80) {
+        out[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800) {
+        out[0] = (char)(0xC0 | code >> 6);
+        out[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    if (code < 0x10000) {
+        out[0] = (char)(0xE0 | code >> 12);
+        out[1] = (char)(0x80 | (code >> 6 & 0x3F));
+        out[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | code >> 18);
+    out[1] = (char)(0x80 | (code >> 12 & 0x3F));
+    out[2] = (char)(0x80 | (code >> 6 & 0x3F));
+    out[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+/* Escapes never grow when decoded, so the output fits in the escaped length. Malformed escapes are kept verbatim. */
+static size_t unescape(const char* p, const char* end, char* out) {
+    size_t length = 0;
+    while (p < end) {
+        if (*p != '\\' || p + 1 >= end) {
+            out[length++] = *p++;
+            continue;
+        }
+        const char c = p[1];
+        p += 2;
+        switch (c) {
+            case '"': out[length++] = '"'; break;
+            case '\\': out[length++] = '\\'; break;
+            case '/': out[length++] = '/'; break;
+            case 'b': out[length++] = '\b'; break;
+            case 'f': out[length++] = '\f'; break;
+            case 'n': out[length++] = '\n'; break;
+            case 'r': out[length++] = '\r'; break;
+            case 't': out[length++] = '\t'; break;
+            case 'u': {
+                i32 code = read_hex4(p, end);
+                if (code < 0) {
+                    out[length++] = '\\';
+                    out[length++] = 'u';
+                    break;
+                }
+                p += 4;
+                if (code >= 0xD800 && code <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    const i32 low = read_hex4(p + 2, end);
+                    if (low >= 0xDC00 && low <= 0xDFFF) {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                }
+                length += write_utf8(out + length, (u32)code);
+                break;
+            }
+            default:
+                out[length++] = '\\';
+                out[length++] = c;
+                break;
+        }
+    }
+    return length;
+}
+
+String json_string(JsonValue value, Arena* arena) {
+    if (json_type(value) != JSON_STRING) return (String){0};
+    const JsonDoc* doc = value.doc;
+    const char* start = doc->input.data + value.offset + 1;
+    const char* end = doc->input.data + doc->index[value.token + 1];
+    if (start == end) return (String){0};
+    char* out = ArenaAllocChars(arena, end - start + 1);
+    size_t length;
+    if (memchr(start, '\\', end - start)) {
+        length = unescape(start, end, out);
+    } else {
+        length = end - start;
+        memcpy(out, start, length);
+    }
+    out[length] = '\0';
+    return (String){ .length = length, .data = out };
+}
+
+/* Matches cJSON's valueint: fractions are truncated and out of range values saturate. */
+i32 json_i32(JsonValue value) {
+    if (json_type(value) != JSON_NUMBER) return 0;
+    const String raw = json_raw(value);
+    const char* p = raw.data;
+    const char* end = raw.data + raw.length;
+    const bool negative = *p == '-';
+    if (negative) p++;
+    i64 result = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        result = Min(result * 10 + (*p - '0'), (i64)I32_MAX + 1);
+        p++;
+    }
+    if (p < end && (*p == '.' || *p == 'e' || *p == 'E')) {
+        char buffer[64];
+        const size_t length = Min(raw.length, sizeof(buffer) - 1);
+        memcpy(buffer, raw.data, length);
+        buffer[length] = '\0';
+        const f64 number = strtod(buffer, nullptr);
+        if (number >= (f64)I32_MAX) return I32_MAX;
+        if (number <= (f64)I32_MIN) return I32_MIN;
+        return (i32)number;
+    }
+    if (negative) return (i32)Max(-result, (i64)I32_MIN);
+    return (i32)Min(result, (i64)I32_MAX);
+}
+
+bool json_bool(JsonValue value) {
+    return json_type(value) == JSON_BOOL && value.doc->input.data[value.offset] == 't';
+}
+
+String json_raw(JsonValue value) {
+    const JsonDoc* doc = value.doc;
+    u32 end;
+    switch (json_type(value)) {
+        case JSON_MISSING:
+            return (String){0};
+        case JSON_STRING:
+            end = doc->index[value.token + 1] + 1;
+            break;
+        case JSON_OBJECT:
+        case JSON_ARRAY:
+            if (!value_end_token(value, &end)) return (String){0};
+            end = doc->index[end - 1] + 1;
+            break;
+        default:
+            end = value.token < doc->count ? doc->index[value.token] : (u32)doc->input.length;
+            while (end > value.offset && (doc->input.data[end - 1] == ' ' || doc->input.data[end - 1] == '\t' ||
+                                          doc->input.data[end - 1] == '\n' || doc->input.data[end - 1] == '\r')) end--;
+            break;
+    }
+    return (String){ .length = end - value.offset, .data = doc->input.data + value.offset };
+}
+
+/* ====== [SCALARS] ====== */
@@ -0,0 +1,73 @@
+#pragma once
+#include "include/base.h"
+
+/* An on-demand JSON reader. json_index finds every quote and every structural character outside of strings in one
+ * pass (AVX2 or SSE4.2 when the CPU has them, scalar otherwise), after that values are located by walking that index,
+ * so only the fields that are asked for are ever decoded and everything else, like long message bodies, is skipped
+ * without looking at its bytes again. */
+
+typedef struct {
+    String input;
+    u32* index;
+    u32 count;
+} JsonDoc;
+
+typedef enum {
+    JSON_MISSING = 0,
+    JSON_OBJECT,
+    JSON_ARRAY,
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_BOOL,
+    JSON_NULL,
+} JsonType;
+
+/* A JsonValue is a position in a JsonDoc: the byte its text starts at and the first index entry at or after it. */
+typedef struct {
+    const JsonDoc* doc;
+    u32 token;
+    u32 offset;
+} JsonValue;
+
+typedef struct {
+    JsonValue array;
+    u32 next;
+    bool done;
+} JsonIter;
+
+/* The index lives in the Arena, the input has to outlive the document but doesn't need a NUL terminator. False for an
+ * unterminated string, brackets that don't nest or close, and commas without a member on both sides. */
+bool json_index(Arena* arena, String input, JsonDoc* doc);
+
+JsonValue json_root(const JsonDoc* doc);
+
+JsonType json_type(JsonValue value);
+
+/* Key lengths are worked out at compile time, a key in the document is only compared against keys of its own length. */
+typedef struct {
+    const char* name;
+    u32 length;
+} JsonKey;
+
+#define JSON_KEY(literal) { .name = literal, .length = sizeof(literal) - 1 }
+
+/* Looks up several keys of one object in a single pass, keys that are missing come back as JSON_MISSING. */
+void json_fields(JsonValue object, const JsonKey* keys, u32 key_count, JsonValue* values);
+
+JsonValue json_field(JsonValue object, const char* key);
+
+JsonIter json_iter(JsonValue array);
+
+bool json_iter_next(JsonIter* iter, JsonValue* element);
+
+/* Unescaped and NUL-terminated in the Arena. Anything that isn't a non-empty string comes back as a null String. */
+String json_string(JsonValue value, Arena* arena);
+
+i32 json_i32(JsonValue value);
+
+bool json_bool(JsonValue value);
+
+/* The exact source text of a value, pointing into the input. */
+String json_raw(JsonValue value);
+
+const char* json_kernel_name(void);
@@ -1,79 +1,178 @@
 #include "library.h"
-#include <cjson/cJSON.h>
 
-Request parse_request_from_json(Arena* arena, const char* json_str) {
-    Request req = {0};
-    cJSON* root = cJSON_Parse(json_str);
-    if (!root) return req;
+/* The typed extractors pull only the fields they need out of an indexed JSON document or a MessagePack body, in one
+ * pass over its keys. Strings are copied into the Arena, empty ones count as missing. */
 
-    cJSON* action = cJSON_GetObjectItem(root, "action");
-    if (cJSON_IsString(action)) req.action = StrNew(arena, action->valuestring);
+static String raw_copy(Arena* arena, String raw) {
+    if (StrIsNull(raw)) return (String){0};
+    char* copy = ArenaAllocChars(arena, raw.length + 1);
+    memcpy(copy, raw.data, raw.length);
+    copy[raw.length] = '\0';
+    return (String){ .length = raw.length, .data = copy };
+}
+
+/* Interned values are looked up straight from the body, only a string with escapes has to be unescaped first. */
+static Symbol json_symbol(JsonValue value, Arena* arena) {
+    if (json_type(value) != JSON_STRING) return 0;
+    const String raw = json_raw(value);
+    const String contents = { .length = raw.length - 2, .data = raw.data + 1 };
+    if (!memchr(contents.data, '\\', contents.length)) return intern(contents);
+    return intern(json_string(value, arena));
+}
+
+static Symbol msgpack_symbol(MsgpackValue value) {
+    return msgpack_type(value) == MSGPACK_STR ? intern(msgpack_view(value)) : 0;
+}
+
+static void push_header(Arena* arena, KeyValueVec* vec, KeyValue pair) {
+    if (StrIsNull(pair.key) || StrIsNull(pair.value)) return;
+    if (vec->length == vec->capacity) {
+        const size_t capacity = vec->capacity ? vec->capacity * 2 : 4;
+        KeyValue* data = ArenaAlloc(arena, sizeof(KeyValue) * capacity);
+        if (vec->length) memcpy(data, vec->data, sizeof(KeyValue) * vec->length);
+        vec->data = data;
+        vec->capacity = capacity;
+    }
+    vec->data[vec->length++] = pair;
+}
 
-    cJSON* method = cJSON_GetObjectItem(root, "method");
-    if (cJSON_IsString(method)) req.method = StrNew(arena, method->valuestring);
+static const JsonKey header_keys[] = { JSON_KEY("key"), JSON_KEY("value") };
 
-    cJSON* url = cJSON_GetObjectItem(root, "url");
-    if (cJSON_IsString(url)) req.url = StrNew(arena, url->valuestring);
+/* Headers come as [{"key": "...", "value": "..."}], entries that aren't string pairs are skipped. */
+static KeyValueVec request_headers_from_json(Arena* arena, JsonValue headers) {
+    KeyValueVec vec = {0};
+    JsonIter iter = json_iter(headers);
+    JsonValue header;
+    while (json_iter_next(&iter, &header)) {
+        JsonValue fields[2];
+        json_fields(header, header_keys, 2, fields);
+        push_header(arena, &vec, (KeyValue){ .key = json_string(fields[0], arena), .value = json_string(fields[1], arena) });
+    }
+    return vec;
+}
 
-    cJSON* headers = cJSON_GetObjectItem(root, "headers");
-    if (cJSON_IsArray(headers)) {
-        cJSON* header = NULL;
+static KeyValueVec request_headers_from_msgpack(Arena* arena, MsgpackValue headers) {
+    KeyValueVec vec = {0};
+    MsgpackIter iter = msgpack_iter(headers);
+    MsgpackValue header;
+    while (msgpack_iter_next(&iter, &header)) {
+        MsgpackValue fields[2];
+        msgpack_fields(header, header_keys, 2, fields);
+        push_header(arena, &vec, (KeyValue){ .key = msgpack_string(fields[0], arena), .value = msgpack_string(fields[1], arena) });
     }
+    return vec;
+}
+
+enum { REQUEST_ACTION, REQUEST_METHOD, REQUEST_URL, REQUEST_HEADERS, REQUEST_BODY, REQUEST_FIELDS };
+static const JsonKey request_keys[REQUEST_FIELDS] = {
+    JSON_KEY("action"), JSON_KEY("method"), JSON_KEY("url"), JSON_KEY("headers"), JSON_KEY("body")
+};
+
+/* The body is forwarded as the exact text it arrived as, a slice of the delivery that is never decoded or copied. */
+Request request_from_json(Arena* arena, JsonValue root) {
+    JsonValue fields[REQUEST_FIELDS];
+    json_fields(root, request_keys, REQUEST_FIELDS, fields);
+    Request req = {
+        .action = json_symbol(fields[REQUEST_ACTION], arena),
+        .method = json_symbol(fields[REQUEST_METHOD], arena),
+        .url = json_string(fields[REQUEST_URL], arena),
+        .headers = request_headers_from_json(arena, fields[REQUEST_HEADERS]),
+    };
+    const JsonType body_type = json_type(fields[REQUEST_BODY]);
+    if (body_type == JSON_OBJECT || body_type == JSON_ARRAY) req.body = json_raw(fields[REQUEST_BODY]);
     return req;
 }
 
-Chat parse_chat_from_json(Arena* arena, const char* json_str) {
-    Chat chat = {0};
-    cJSON* root = cJSON_Parse(json_str);
-    if (!root) return chat;
-    cJSON* id = cJSON_GetObjectItem(root, "id");
-    if (cJSON_IsNumber(id)) chat.id = id->valueint;
-    cJSON* situation = cJSON_GetObjectItem(root, "situation");
-    if (cJSON_IsString(situation)) chat.situation = StrNew(arena, situation->valuestring);
-    cJSON* is_active = cJSON_GetObjectItem(root, "is_active");
-    if (cJSON_IsBool(is_active)) chat.is_active = cJSON_IsTrue(is_active);
-    cJSON* agent_id = cJSON_GetObjectItem(root, "agent_id");
-    if (cJSON_IsNumber(agent_id)) chat.agent_id = agent_id->valueint;
-    cJSON* tabulation = cJSON_GetObjectItem(root, "tabulation");
-    if (cJSON_IsString(tabulation)) chat.tabulation = StrNew(arena, tabulation->valuestring);
-    cJSON* customer_id = cJSON_GetObjectItem(root, "customer_id");
-    if (cJSON_IsNumber(customer_id)) chat.customer_id = customer_id->valueint;
-    cJSON_Delete(root);
-    return chat;
+/* The HTTP body still goes out as JSON, a map or array body is rendered as JSON text, a str or bin body is taken to be
+ * the already serialised payload. */
+Request request_from_msgpack(Arena* arena, MsgpackValue root) {
+    MsgpackValue fields[REQUEST_FIELDS];
+    msgpack_fields(root, request_keys, REQUEST_FIELDS, fields);
+    Request req = {
+        .action = msgpack_symbol(fields[REQUEST_ACTION]),
+        .method = msgpack_symbol(fields[REQUEST_METHOD]),
+        .url = msgpack_string(fields[REQUEST_URL], arena),
+        .headers = request_headers_from_msgpack(arena, fields[REQUEST_HEADERS]),
+    };
+    switch (msgpack_type(fields[REQUEST_BODY])) {
+        case MSGPACK_MAP:
+        case MSGPACK_ARRAY:
+            req.body = msgpack_to_json(fields[REQUEST_BODY], arena);
+            break;
+        case MSGPACK_STR:
+        case MSGPACK_BIN:
+            req.body = msgpack_view(fields[REQUEST_BODY]);
+            break;
+        default:
+            break;
+    }
+    return req;
 }
 
-Message parse_message_from_json(Arena* arena, const char* json_str) {
-    Message msg = {0};
-    cJSON* root = cJSON_Parse(json_str);
-    if (!root) return msg;
-    cJSON* id = cJSON_GetObjectItem(root, "id");
-    if (cJSON_IsNumber(id)) msg.id = id->valueint;
-    cJSON* from = cJSON_GetObjectItem(root, "from");
-    if (cJSON_IsString(from)) msg.from = StrNew(arena, from->valuestring);
-    cJSON* to = cJSON_GetObjectItem(root, "to");
-    if (cJSON_IsString(to)) msg.to = StrNew(arena, to->valuestring);
-    cJSON* delivered = cJSON_GetObjectItem(root, "delivered");
-    if (cJSON_IsBool(delivered)) msg.delivered = cJSON_IsTrue(delivered);
-    cJSON* text = cJSON_GetObjectItem(root, "text");
-    if (cJSON_IsString(text)) msg.text = StrNew(arena, text->valuestring);
-    cJSON* chat_id = cJSON_GetObjectItem(root, "chat_id");
-    if (cJSON_IsNumber(chat_id)) msg.chat_id = chat_id->valueint;
-    cJSON_Delete(root);
-    return msg;
+/* The entity parsers are generated from schema.h for each payload format, each reads its fields in one pass. */
+#define JSON_READ_INT(value, arena) json_i32(value)
+#define JSON_READ_TEXT(value, arena) json_string(value, arena)
+#define JSON_READ_SYMBOL(value, arena) json_symbol(value, arena)
+#define JSON_READ_BOOL(value, arena) json_bool(value)
+#define MSGPACK_READ_INT(value, arena) msgpack_i32(value)
+#define MSGPACK_READ_TEXT(value, arena) msgpack_string(value, arena)
+#define MSGPACK_READ_SYMBOL(value, arena) msgpack_symbol(value)
+#define MSGPACK_READ_BOOL(value, arena) msgpack_bool(value)
+#define SCHEMA_READ_json(kind, name, presence, column_type) .name = JSON_READ_##kind(fields[SCHEMA_FIELD_##name], arena),
+#define SCHEMA_READ_msgpack(kind, name, presence, column_type) .name = MSGPACK_READ_##kind(fields[SCHEMA_FIELD_##name], arena),
+
+#define SCHEMA_PARSER(Type, function, SCHEMA, Value, format)                       \
+    Type function(Arena* arena, Value root) {                                      \
+        (void)arena;                                                               \
+        enum { SCHEMA(SCHEMA_FIELD_INDEX) };                                       \
+        static const JsonKey keys[] = { SCHEMA(SCHEMA_JSON_KEY) };                 \
+        Value fields[SCHEMA_FIELD_COUNT(SCHEMA)];                                  \
+        format##_fields(root, keys, SCHEMA_FIELD_COUNT(SCHEMA), fields);           \
+        return (Type){ SCHEMA(SCHEMA_READ_##format) };                             \
+    }
+
+SCHEMA_PARSER(Chat, chat_from_json, CHAT_SCHEMA, JsonValue, json)
+SCHEMA_PARSER(Message, message_from_json, MESSAGE_SCHEMA, JsonValue, json)
+SCHEMA_PARSER(Customer, customer_from_json, CUSTOMER_SCHEMA, JsonValue, json)
+SCHEMA_PARSER(Chat, chat_from_msgpack, CHAT_SCHEMA, MsgpackValue, msgpack)
+SCHEMA_PARSER(Message, message_from_msgpack, MESSAGE_SCHEMA, MsgpackValue, msgpack)
+SCHEMA_PARSER(Customer, customer_from_msgpack, CUSTOMER_SCHEMA, MsgpackValue, msgpack)
+
+/* Only webhooks that carry a new message are pushed to a chat, status updates and the like are skipped. */
+static bool is_message_event(const char* event) {
+    return strcasecmp(event, "messages.upsert") == 0 || strcasecmp(event, "MESSAGES_UPSERT") == 0 ||
+           strcasecmp(event, "send.message") == 0 || strcasecmp(event, "SEND_MESSAGE") == 0;
 }
 
-Customer parse_customer_from_json(Arena* arena, const char* json_str) {
-    Customer cust = {0};
-    cJSON* root = cJSON_Parse(json_str);
-    if (!root) return cust;
-    cJSON* id = cJSON_GetObjectItem(root, "id");
-    if (cJSON_IsNumber(id)) cust.id = id->valueint;
-    cJSON* name = cJSON_GetObjectItem(root, "name");
-    if (cJSON_IsString(name)) cust.name = StrNew(arena, name->valuestring);
-    cJSON* number = cJSON_GetObjectItem(root, "number");
-    if (cJSON_IsString(number)) cust.number = StrNew(arena, number->valuestring);
-    cJSON* last_chat_id = cJSON_GetObjectItem(root, "last_chat_id");
-    if (cJSON_IsString(last_chat_id)) cust.last_chat_id = StrNew(arena, last_chat_id->valuestring);
-    cJSON_Delete(root);
-    return cust;
+enum { WEBHOOK_EVENT, WEBHOOK_APIKEY, WEBHOOK_DATA, WEBHOOK_FIELDS };
+static const JsonKey webhook_keys[WEBHOOK_FIELDS] = { JSON_KEY("event"), JSON_KEY("apikey"), JSON_KEY("data") };
+
+enum { DATA_KEY, DATA_STATUS, DATA_MESSAGE, DATA_FIELDS };
+static const JsonKey data_keys[DATA_FIELDS] = { JSON_KEY("key"), JSON_KEY("status"), JSON_KEY("message") };
+
+static const JsonKey key_keys[] = { JSON_KEY("remoteJid"), JSON_KEY("id") };
+
+Webhook parse_webhook_from_json(Arena* arena, String json) {
+    Webhook webhook = {0};
+    JsonDoc doc;
+    if (!json_index(arena, json, &doc)) return webhook;
+    JsonValue fields[WEBHOOK_FIELDS];
+    json_fields(json_root(&doc), webhook_keys, WEBHOOK_FIELDS, fields);
+    const String event = json_string(fields[WEBHOOK_EVENT], arena);
+    if (!StrIsNull(event) && !is_message_event(event.data)) return webhook;
+    webhook.apikey = json_string(fields[WEBHOOK_APIKEY], arena);
+
+    const JsonValue data = fields[WEBHOOK_DATA];
+    if (json_type(data) != JSON_OBJECT) return webhook;
+    JsonValue data_fields[DATA_FIELDS];
+    json_fields(data, data_keys, DATA_FIELDS, data_fields);
+    JsonValue key_fields[2];
+    json_fields(data_fields[DATA_KEY], key_keys, 2, key_fields);
+    webhook.message_remotejid = json_string(key_fields[0], arena);
+    webhook.key = json_string(key_fields[1], arena);
+    webhook.message_status_string = json_string(data_fields[DATA_STATUS], arena);
+    webhook.message_conversation = json_string(json_field(data_fields[DATA_MESSAGE], "conversation"), arena);
+    /* The whole data object is what gets pushed to the chat, copied as it arrived instead of re-serialised. */
+    webhook.message = raw_copy(arena, json_raw(data));
+    return webhook;
 }
@@ -1,6 +1,8 @@
 #pragma once
 #include "include/base.h"
-#include <cjson/cJSON.h>
+#include "json.h"
+#include "msgpack.h"
+#include "schema.h"
 
 /* Library will hold the structs and types for most of the project, including the structs i will parse json into.*/
 
@@ -14,12 +16,13 @@ typedef struct {
 
 VEC_TYPE(KeyValueVec, KeyValue);
 
+/* The body usually points into the delivery itself and isn't NUL-terminated, it is always sent with its length. */
 typedef struct {
-    String action;
-    String method;
+    Symbol action;
+    Symbol method;
     String url;
     KeyValueVec headers;
-    cJSON body;
+    String body;
 } Request;
 
 /* ====== [REQUEST TYPES] ====== */
@@ -28,28 +31,15 @@ typedef struct {
 /* ====== [WASOL TYPES] ====== */
 
 typedef struct {
-    i32 id;
-    String situation;
-    bool is_active;
-    i32 agent_id;
-    String tabulation;
-    i32 customer_id;
+    CHAT_SCHEMA(SCHEMA_STRUCT_FIELD)
 } Chat;
 
 typedef struct {
-    i32 id;
-    String from;
-    String to;
-    bool delivered;
-    String text;
-    i32 chat_id;
+    MESSAGE_SCHEMA(SCHEMA_STRUCT_FIELD)
 } Message;
 
 typedef struct {
-    i32 id;
-    String name;
-    String number;
-    String last_chat_id;
+    CUSTOMER_SCHEMA(SCHEMA_STRUCT_FIELD)
 } Customer;
 
 /* ====== [WASOL TYPES] ====== */
@@ -63,11 +53,17 @@ typedef struct {
     String message_status_string;
     String key;
     String message;
+    String apikey;
 } Webhook;
 
 /* ====== [WEBHOOK TYPES] ====== */
 
-Request parse_request_from_json(Arena* arena, const char* json_str);
-Customer parse_customer_from_json(Arena* arena, const char* json_str);
-Message parse_message_from_json(Arena* arena, const char* json_str);
-Chat parse_chat_from_json(Arena* arena, const char* json_str);
\ No newline at end of file
+Request request_from_json(Arena* arena, JsonValue root);
+Customer customer_from_json(Arena* arena, JsonValue root);
+Message message_from_json(Arena* arena, JsonValue root);
+Chat chat_from_json(Arena* arena, JsonValue root);
+Request request_from_msgpack(Arena* arena, MsgpackValue root);
+Customer customer_from_msgpack(Arena* arena, MsgpackValue root);
+Message message_from_msgpack(Arena* arena, MsgpackValue root);
+Chat chat_from_msgpack(Arena* arena, MsgpackValue root);
+Webhook parse_webhook_from_json(Arena* arena, String json);
\ No newline at end of file
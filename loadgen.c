@@ -0,0 +1,298 @@
+#include "include/base.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <rabbitmq-c/amqp.h>
+#include "config.h"
+#include "rabbit.h"
+
+/* Loadgen publishes synthetic WaSol traffic to the outgoing queue at a fixed rate, so the consumer's throughput and
+ * latency can be measured before a deploy. Connection settings come from the same .env as the consumer.
+ *
+ *   WaSolLoadGen [--rate=N] [--count=N] [--duration=S] [--mix=chat:1,customer:1,message:6,request:2]
+ *                [--size=BYTES] [--chats=N] [--queue=NAME] [--url=URL]
+ *
+ * --rate=0 publishes as fast as the broker accepts. Payloads carry the same fields the *_from_json extractors read,
+ * ids are drawn from --chats so upserts keep hitting a realistic, bounded set of rows. */
+
+#define LOADGEN_MAX_PAYLOAD (1024 * 1024)
+#define LOADGEN_REPORT_MS 1000
+
+typedef enum {
+    PAYLOAD_CHAT = 0,
+    PAYLOAD_CUSTOMER,
+    PAYLOAD_MESSAGE,
+    PAYLOAD_REQUEST,
+    PAYLOAD_KIND_COUNT,
+} PayloadKind;
+
+static const char* payload_names[PAYLOAD_KIND_COUNT] = { "chat", "customer", "message", "request" };
+
+typedef struct {
+    i64 rate;
+    i64 count;
+    i64 duration_s;
+    i32 weights[PAYLOAD_KIND_COUNT];
+    i32 weight_total;
+    i32 size;
+    i32 chats;
+    const char* queue;
+    const char* url;
+} LoadgenOptions;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_signal(int signal) {
+    (void)signal;
+    stop_requested = 1;
+}
+
+static i64 monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ====== [OPTIONS] ====== */
+
+static bool parse_i64(const char* value, i64 min, i64* out) {
+    char* endptr;
+    const long long parsed = strtoll(value, &endptr, 10);
+    if (*value == '\0' || *endptr != '\0' || parsed < min) return false;
+    *out = parsed;
+    return true;
+}
+
+/* Mix entries are "kind:weight" pairs, kinds that are left out get a weight of zero. */
+static bool parse_mix(const char* value, LoadgenOptions* options) {
+    memset(options->weights, 0, sizeof(options->weights));
+    options->weight_total = 0;
+    const char* p = value;
+    while (*p) {
+        const char* colon = strchr(p, ':');
+        if (!colon) return false;
+        i32 kind = -1;
+        for (i32 i = 0; i < PAYLOAD_KIND_COUNT; i++) {
+            if ((size_t)(colon - p) == strlen(payload_names[i]) && strncmp(p, payload_names[i], colon - p) == 0) kind = i;
+        }
+        if (kind < 0) return false;
+        char* endptr;
+        const long weight = strtol(colon + 1, &endptr, 10);
+        if (endptr == colon + 1 || weight < 0 || weight > 1000) return false;
+        options->weights[kind] = (i32)weight;
+        options->weight_total += (i32)weight;
+        if (*endptr != ',' && *endptr != '\0') return false;
+        p = *endptr == ',' ? endptr + 1 : endptr;
+    }
+    return options->weight_total > 0;
+}
+
+static bool option_is(const char* arg, size_t name_len, const char* name) {
+    return strlen(name) == name_len && strncmp(arg, name, name_len) == 0;
+}
+
+static bool parse_options(int argc, char** argv, LoadgenOptions* options) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* eq = strchr(arg, '=');
+        if (strncmp(arg, "--", 2) != 0 || !eq) {
+            LogError("Loadgen: Unexpected argument '%s'", arg);
+            return false;
+        }
+        const char* value = eq + 1;
+        const size_t name_len = eq - arg;
+        i64 number;
+        bool ok = true;
+        if (option_is(arg, name_len, "--rate")) {
+            ok = parse_i64(value, 0, &options->rate);
+        } else if (option_is(arg, name_len, "--count")) {
+            ok = parse_i64(value, 0, &options->count);
+        } else if (option_is(arg, name_len, "--duration")) {
+            ok = parse_i64(value, 0, &options->duration_s);
+        } else if (option_is(arg, name_len, "--mix")) {
+            ok = parse_mix(value, options);
+        } else if (option_is(arg, name_len, "--size")) {
+            ok = parse_i64(value, 0, &number) && number <= LOADGEN_MAX_PAYLOAD / 2;
+            options->size = (i32)number;
+        } else if (option_is(arg, name_len, "--chats")) {
+            ok = parse_i64(value, 1, &number) && number <= I32_MAX;
+            options->chats = (i32)number;
+        } else if (option_is(arg, name_len, "--queue")) {
+            options->queue = value;
+        } else if (option_is(arg, name_len, "--url")) {
+            options->url = value;
+        } else {
+            LogError("Loadgen: Unknown option '%.*s'", (int)name_len, arg);
+            return false;
+        }
+        if (!ok) {
+            LogError("Loadgen: Invalid value for '%.*s': %s", (int)name_len, arg, value);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* ====== [OPTIONS] ====== */
+
+
+/* ====== [PAYLOADS] ====== */
+
+static PayloadKind pick_kind(const LoadgenOptions* options) {
+    i32 roll = RandomInteger(0, options->weight_total - 1);
+    for (i32 i = 0; i < PAYLOAD_KIND_COUNT; i++) {
+        if (roll < options->weights[i]) return (PayloadKind)i;
+        roll -= options->weights[i];
+    }
+    return PAYLOAD_MESSAGE;
+}
+
+/* Filler text is plain ASCII so it never needs escaping and its length is exactly the requested size. */
+static void fill_text(char* text, i32 size) {
+    static const char words[] = "lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor ";
+    for (i32 i = 0; i < size; i++) text[i] = words[i % (sizeof(words) - 1)];
+    text[size] = '\0';
+}
+
+static int build_payload(PayloadKind kind, const LoadgenOptions* options, const char* text, i64 sequence, char* out) {
+    const i32 chat_id = RandomInteger(1, options->chats);
+    const i32 customer_id = RandomInteger(1, options->chats);
+    switch (kind) {
+        case PAYLOAD_CHAT:
+            return snprintf(out, LOADGEN_MAX_PAYLOAD,
+                "{\"action\":\"upsertChat\",\"id\":%d,\"situation\":\"%s\",\"is_active\":%s,\"agent_id\":%d,"
+                "\"tabulation\":\"loadgen\",\"customer_id\":%d}",
+                chat_id, sequence % 3 == 0 ? "closed" : "open", sequence % 3 == 0 ? "false" : "true",
+                RandomInteger(1, 50), customer_id);
+        case PAYLOAD_CUSTOMER:
+            return snprintf(out, LOADGEN_MAX_PAYLOAD,
+                "{\"action\":\"upsertCustomer\",\"id\":%d,\"name\":\"Loadgen Customer %d\",\"number\":\"55119%08d\","
+                "\"last_chat_id\":\"%d\"}",
+                customer_id, customer_id, customer_id, chat_id);
+        case PAYLOAD_MESSAGE:
+            return snprintf(out, LOADGEN_MAX_PAYLOAD,
+                "{\"action\":\"sendMessage\",\"id\":%" PRId64 ",\"from\":\"55119%08d\",\"to\":\"5511900000000\","
+                "\"delivered\":false,\"text\":\"%s\",\"chat_id\":%d}",
+                sequence % I32_MAX, customer_id, text, chat_id);
+        case PAYLOAD_REQUEST:
+            return snprintf(out, LOADGEN_MAX_PAYLOAD,
+                "{\"action\":\"sendRequest\",\"method\":\"POST\",\"url\":\"%s\","
+                "\"headers\":[{\"key\":\"Content-Type\",\"value\":\"application/json\"}],"
+                "\"body\":{\"chat_id\":%d,\"text\":\"%s\"}}",
+                options->url, chat_id, text);
+        default:
+            return -1;
+    }
+}
+
+/* ====== [PAYLOADS] ====== */
+
+
+static bool publish(amqp_connection_state_t conn, const char* queue, const char* body, int length) {
+    amqp_basic_properties_t properties = {0};
+    properties._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_DELIVERY_MODE_FLAG;
+    properties.content_type = amqp_cstring_bytes("application/json");
+    properties.delivery_mode = AMQP_DELIVERY_PERSISTENT;
+    const amqp_bytes_t payload = { .len = (size_t)length, .bytes = (void*)body };
+    const int status = amqp_basic_publish(conn, RABBIT_CHANNEL, amqp_empty_bytes, amqp_cstring_bytes(queue), 0, 0,
+                                          &properties, payload);
+    if (status != AMQP_STATUS_OK) {
+        LogError("Loadgen: Publish failed: %s", amqp_error_string2(status));
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    Arena* arena = ArenaCreate(1024 * 1024);
+    Dotenv* dotenv = load_env(arena);
+
+    LoadgenOptions options = {
+        .rate = 1000,
+        .weights = { 1, 1, 6, 2 },
+        .weight_total = 10,
+        .size = 64,
+        .chats = 1000,
+        .queue = dotenv->outgoing_queue.data,
+        .url = "http://127.0.0.1:8080/loadgen",
+    };
+    if (!parse_options(argc, argv, &options)) {
+        ArenaFree(arena);
+        return 1;
+    }
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    RandomSetSeed((u64)monotonic_ns());
+
+    amqp_connection_state_t conn = connect_rabbitmq(dotenv);
+    if (!conn) {
+        ArenaFree(arena);
+        return 1;
+    }
+    amqp_channel_open(conn, RABBIT_CHANNEL);
+    if (amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL) {
+        LogError("Loadgen: Opening channel failed");
+        drop_rabbitmq(conn);
+        ArenaFree(arena);
+        return 1;
+    }
+
+    char* text = ArenaAlloc(arena, options.size + 1);
+    char* body = ArenaAlloc(arena, LOADGEN_MAX_PAYLOAD);
+    fill_text(text, options.size);
+
+    LogInfo("Loadgen: Publishing to '%s' at %" PRId64 " msg/s (0 = unlimited), mix chat:%d customer:%d message:%d request:%d, text %d bytes",
+            options.queue, options.rate, options.weights[PAYLOAD_CHAT], options.weights[PAYLOAD_CUSTOMER],
+            options.weights[PAYLOAD_MESSAGE], options.weights[PAYLOAD_REQUEST], options.size);
+
+    /* Each message has a scheduled send time, so a slow publish is caught up on instead of lowering the rate. */
+    const i64 interval_ns = options.rate > 0 ? 1000000000LL / options.rate : 0;
+    const i64 started = monotonic_ns();
+    const i64 deadline = options.duration_s > 0 ? started + options.duration_s * 1000000000LL : 0;
+    i64 sent = 0, bytes = 0, last_report = started, last_sent = 0;
+    i64 per_kind[PAYLOAD_KIND_COUNT] = {0};
+
+    while (!stop_requested && (options.count == 0 || sent < options.count)) {
+        i64 now = monotonic_ns();
+        if (deadline && now >= deadline) break;
+        if (interval_ns > 0) {
+            const i64 due = started + sent * interval_ns;
+            if (due > now) {
+                const struct timespec pause = { .tv_sec = (due - now) / 1000000000LL, .tv_nsec = (due - now) % 1000000000LL };
+                nanosleep(&pause, nullptr);
+                now = monotonic_ns();
+            }
+        }
+
+        const PayloadKind kind = pick_kind(&options);
+        const int length = build_payload(kind, &options, text, sent + 1, body);
+        if (length < 0 || length >= LOADGEN_MAX_PAYLOAD) {
+            LogError("Loadgen: Payload doesn't fit in %d bytes", LOADGEN_MAX_PAYLOAD);
+            break;
+        }
+        if (!publish(conn, options.queue, body, length)) break;
+        sent++;
+        bytes += length;
+        per_kind[kind]++;
+
+        if ((now - last_report) / 1000000 >= LOADGEN_REPORT_MS) {
+            LogInfo("Loadgen: %" PRId64 " sent, %.0f msg/s", sent,
+                    (sent - last_sent) * 1e9 / (f64)(now - last_report));
+            last_report = now;
+            last_sent = sent;
+        }
+    }
+
+    const f64 elapsed_s = (monotonic_ns() - started) / 1e9;
+    LogSuccess("Loadgen: Sent %" PRId64 " messages (%" PRId64 " bytes) in %.2fs, %.0f msg/s", sent, bytes, elapsed_s,
+               elapsed_s > 0 ? sent / elapsed_s : 0.0);
+    for (i32 i = 0; i < PAYLOAD_KIND_COUNT; i++) {
+        LogInfo("Loadgen:   %-8s %" PRId64, payload_names[i], per_kind[i]);
+    }
+
+    close_rabbitmq(conn);
+    ArenaFree(arena);
+    return 0;
+}
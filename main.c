@@ -1,11 +1,73 @@
 #include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <curl/curl.h>
 #include "config.h"
+#include "intern.h"
+#include "worker.h"
+#include "event_loop.h"
+#include "replay.h"
+
+static void handle_signal(int signal) {
+    (void)signal;
+    workers_request_stop();
+}
 
 int main(void) {
     Arena* arena = ArenaCreate(1024 * 1024);
 
     Dotenv* dotenv = load_env(arena);
+    if (!intern_init(dotenv->intern_max_symbols)) {
+        ArenaFree(arena);
+        return 1;
+    }
+
+    /* curl_global_init is not thread-safe, so it has to run before any worker calls curl_easy_init. */
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    if (dotenv->mode != CONSUMER_WORKERS) {
+        if (dotenv->mode == CONSUMER_EVENT_LOOP) {
+            run_event_loop(dotenv);
+        } else {
+            run_replay(dotenv);
+        }
+        curl_global_cleanup();
+        ArenaFree(arena);
+        return 0;
+    }
+
+    /* Only outgoing workers write to Postgres, the pool is sized on its own with DB_POOL_SIZE. */
+    DbPool* pool = db_pool_new(dotenv->db_url.data, dotenv->db_pool_size, dotenv->db_pool_health_ms);
+
+    const i32 worker_count = dotenv->worker_count + dotenv->incoming_workers;
+    Worker* workers = ArenaAlloc(arena, sizeof(Worker) * worker_count);
+    pthread_t* threads = ArenaAlloc(arena, sizeof(pthread_t) * worker_count);
+
+    i32 started = 0;
+    for (i32 i = 0; i < worker_count; i++) {
+        const bool incoming = i >= dotenv->worker_count;
+        workers[i] = (Worker){
+            .id = i,
+            .kind = incoming ? WORKER_INCOMING : WORKER_OUTGOING,
+            .env = dotenv,
+            .queue_name = incoming ? dotenv->incoming_queue.data : dotenv->outgoing_queue.data,
+            .pool = pool,
+        };
+        if (pthread_create(&threads[i], nullptr, worker_run, &workers[i]) != 0) {
+            LogError("Couldn't start worker %d.", i);
+            break;
+        }
+        started++;
+    }
+    LogInfo("Started %d workers on '%s' and '%s'.", started, dotenv->outgoing_queue.data, dotenv->incoming_queue.data);
 
+    for (i32 i = 0; i < started; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    db_pool_free(pool);
 
+    curl_global_cleanup();
     ArenaFree(arena);
-}
\ No newline at end of file
+}
@@ -0,0 +1,334 @@
+#include "msgpack.h"
+#include <math.h>
+#include <string.h>
+
+/* Nesting deeper than this is refused when rendering JSON, nothing we receive comes close. */
+#define MSGPACK_MAX_DEPTH 64
+
+/* The decoded first bytes of a value: how long the header is, and either the payload length (str, bin, ext), the
+ * element count (array, map) or the scalar itself. */
+typedef struct {
+    MsgpackType type;
+    u32 header;
+    u64 length;
+    i64 integer;
+    f64 number;
+} Header;
+
+static u64 read_be(const u8* p, u32 bytes) {
+    u64 value = 0;
+    for (u32 i = 0; i < bytes; i++) value = (value << 8) | p[i];
+    return value;
+}
+
+/* ====== [FORMAT] ====== */
+
+static bool read_header(const u8* p, const u8* end, Header* h) {
+    if (!p || p >= end) return false;
+    const u8 byte = *p;
+    const size_t available = end - p;
+    *h = (Header){ .header = 1 };
+
+    if (byte <= 0x7f || byte >= 0xe0) {
+        h->type = MSGPACK_INT;
+        h->integer = (i8)byte;
+        if (byte <= 0x7f) h->integer = byte;
+        return true;
+    }
+    if (byte <= 0x8f) {
+        h->type = MSGPACK_MAP;
+        h->length = byte & 0x0f;
+    } else if (byte <= 0x9f) {
+        h->type = MSGPACK_ARRAY;
+        h->length = byte & 0x0f;
+    } else if (byte <= 0xbf) {
+        h->type = MSGPACK_STR;
+        h->length = byte & 0x1f;
+    } else {
+        /* Everything from 0xc0 up is a tag followed by a big-endian length or value of 0 to 8 bytes. */
+        u32 size = 0;
+        switch (byte) {
+            case 0xc0: h->type = MSGPACK_NIL; break;
+            case 0xc2: case 0xc3: h->type = MSGPACK_BOOL; h->integer = byte & 1; break;
+            case 0xc4: case 0xc5: case 0xc6: h->type = MSGPACK_BIN; size = 1u << (byte - 0xc4); break;
+            case 0xc7: case 0xc8: case 0xc9: h->type = MSGPACK_EXT; size = 1u << (byte - 0xc7); break;
+            case 0xca: h->type = MSGPACK_FLOAT; size = 4; break;
+            case 0xcb: h->type = MSGPACK_FLOAT; size = 8; break;
+            case 0xcc: case 0xcd: case 0xce: case 0xcf: h->type = MSGPACK_INT; size = 1u << (byte - 0xcc); break;
+            case 0xd0: case 0xd1: case 0xd2: case 0xd3: h->type = MSGPACK_INT; size = 1u << (byte - 0xd0); break;
+            case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+                h->type = MSGPACK_EXT;
+                h->length = 1u << (byte - 0xd4);
+                break;
+            case 0xd9: case 0xda: case 0xdb: h->type = MSGPACK_STR; size = 1u << (byte - 0xd9); break;
+            case 0xdc: case 0xdd: h->type = MSGPACK_ARRAY; size = 2u << (byte - 0xdc); break;
+            case 0xde: case 0xdf: h->type = MSGPACK_MAP; size = 2u << (byte - 0xde); break;
+            default: return false;
+        }
+        /* ext carries its type byte between the length and the data, fixext right after the tag. */
+        const u32 ext_type = h->type == MSGPACK_EXT ? 1 : 0;
+        h->header = 1 + size + ext_type;
+        if (available < h->header) return false;
+        const u64 value = read_be(p + 1, size);
+        if (byte == 0xca) {
+            const u32 bits = (u32)value;
+            f32 number;
+            memcpy(&number, &bits, sizeof(number));
+            h->number = number;
+        } else if (byte == 0xcb) {
+            memcpy(&h->number, &value, sizeof(h->number));
+        } else if (byte >= 0xcc && byte <= 0xcf) {
+            h->integer = value > (u64)I64_MAX ? I64_MAX : (i64)value;
+        } else if (byte >= 0xd0 && byte <= 0xd3) {
+            /* Sign-extend from the encoded width. */
+            const u32 shift = 64 - size * 8;
+            h->integer = (i64)(value << shift) >> shift;
+        } else if (h->type != MSGPACK_NIL && h->type != MSGPACK_BOOL && size > 0) {
+            h->length = value;
+        }
+    }
+
+    if (available < h->header) return false;
+    const bool has_payload = h->type == MSGPACK_STR || h->type == MSGPACK_BIN || h->type == MSGPACK_EXT;
+    if (has_payload && h->length > available - h->header) return false;
+    return true;
+}
+
+/* Arrays and maps are skipped by counting the values still owed instead of recursing, so nesting costs nothing. */
+static const u8* skip_value(const u8* p, const u8* end) {
+    u64 remaining = 1;
+    while (remaining > 0) {
+        Header h;
+        if (!read_header(p, end, &h)) return nullptr;
+        p += h.header;
+        switch (h.type) {
+            case MSGPACK_STR: case MSGPACK_BIN: case MSGPACK_EXT: p += h.length; break;
+            case MSGPACK_ARRAY: remaining += h.length; break;
+            case MSGPACK_MAP: remaining += h.length * 2; break;
+            default: break;
+        }
+        remaining--;
+        /* Every value owed takes at least one byte, a count larger than what's left can't be valid. */
+        if (remaining > (u64)(end - p)) return nullptr;
+    }
+    return p;
+}
+
+/* ====== [FORMAT] ====== */
+
+
+/* ====== [NAVIGATION] ====== */
+
+MsgpackValue msgpack_root(String input) {
+    if (StrIsNull(input) || input.length == 0) return (MsgpackValue){0};
+    return (MsgpackValue){ .data = (const u8*)input.data, .end = (const u8*)input.data + input.length };
+}
+
+MsgpackType msgpack_type(MsgpackValue value) {
+    Header h;
+    if (!read_header(value.data, value.end, &h)) return MSGPACK_MISSING;
+    return h.type;
+}
+
+void msgpack_fields(MsgpackValue map, const JsonKey* keys, u32 key_count, MsgpackValue* values) {
+    memset(values, 0, sizeof(MsgpackValue) * key_count);
+    Header h;
+    if (!read_header(map.data, map.end, &h) || h.type != MSGPACK_MAP) return;
+    const u8* p = map.data + h.header;
+    u32 remaining = key_count;
+    for (u64 i = 0; i < h.length && remaining > 0; i++) {
+        Header key;
+        if (!read_header(p, map.end, &key)) return;
+        const u8* value = skip_value(p, map.end);
+        const u8* next = value ? skip_value(value, map.end) : nullptr;
+        if (!next) return;
+        if (key.type == MSGPACK_STR) {
+            const u8* name = p + key.header;
+            for (u32 k = 0; k < key_count; k++) {
+                if (!values[k].data && keys[k].length == key.length && memcmp(keys[k].name, name, key.length) == 0) {
+                    values[k] = (MsgpackValue){ .data = value, .end = map.end };
+                    remaining--;
+                    break;
+                }
+            }
+        }
+        p = next;
+    }
+}
+
+MsgpackValue msgpack_field(MsgpackValue map, const char* key) {
+    const JsonKey lookup = { .name = key, .length = (u32)strlen(key) };
+    MsgpackValue value;
+    msgpack_fields(map, &lookup, 1, &value);
+    return value;
+}
+
+MsgpackIter msgpack_iter(MsgpackValue array) {
+    Header h;
+    if (!read_header(array.data, array.end, &h) || h.type != MSGPACK_ARRAY) return (MsgpackIter){0};
+    const u8* next = array.data + h.header;
+    /* Like in skip_value, every element takes at least one byte, so no more can be left than bytes are. */
+    if (h.length > (u64)(array.end - next)) return (MsgpackIter){0};
+    return (MsgpackIter){ .next = next, .end = array.end, .remaining = (u32)h.length };
+}
+
+bool msgpack_iter_next(MsgpackIter* iter, MsgpackValue* element) {
+    if (iter->remaining == 0) return false;
+    const u8* next = skip_value(iter->next, iter->end);
+    if (!next) {
+        iter->remaining = 0;
+        return false;
+    }
+    *element = (MsgpackValue){ .data = iter->next, .end = iter->end };
+    iter->next = next;
+    iter->remaining--;
+    return true;
+}
+
+/* ====== [NAVIGATION] ====== */
+
+
+/* ====== [SCALARS] ====== */
+
+String msgpack_view(MsgpackValue value) {
+    Header h;
+    if (!read_header(value.data, value.end, &h) || (h.type != MSGPACK_STR && h.type != MSGPACK_BIN)) return (String){0};
+    return (String){ .length = h.length, .data = (char*)value.data + h.header };
+}
+
+String msgpack_string(MsgpackValue value, Arena* arena) {
+    if (msgpack_type(value) != MSGPACK_STR) return (String){0};
+    const String view = msgpack_view(value);
+    if (view.length == 0) return (String){0};
+    char* copy = ArenaAllocChars(arena, view.length + 1);
+    memcpy(copy, view.data, view.length);
+    copy[view.length] = '\0';
+    return (String){ .length = view.length, .data = copy };
+}
+
+/* Same rules as json_i32: fractions are truncated and out of range values saturate. */
+i32 msgpack_i32(MsgpackValue value) {
+    Header h;
+    if (!read_header(value.data, value.end, &h)) return 0;
+    if (h.type == MSGPACK_INT) return (i32)Clamp((i64)I32_MIN, h.integer, (i64)I32_MAX);
+    if (h.type != MSGPACK_FLOAT || isnan(h.number)) return 0;
+    if (h.number >= (f64)I32_MAX) return I32_MAX;
+    if (h.number <= (f64)I32_MIN) return I32_MIN;
+    return (i32)h.number;
+}
+
+bool msgpack_bool(MsgpackValue value) {
+    Header h;
+    return read_header(value.data, value.end, &h) && h.type == MSGPACK_BOOL && h.integer;
+}
+
+/* ====== [SCALARS] ====== */
+
+
+/* ====== [JSON] ====== */
+
+static void append(Arena* arena, StringBuilder* builder, const char* data, size_t length) {
+    String part = { .length = length, .data = (char*)data };
+    StringBuilderAppend(arena, builder, &part);
+}
+
+static void append_json_string(Arena* arena, StringBuilder* builder, String text) {
+    static const char hex[] = "0123456789abcdef";
+    append(arena, builder, "\"", 1);
+    size_t run = 0;
+    for (size_t i = 0; i < text.length; i++) {
+        const u8 c = (u8)text.data[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        append(arena, builder, text.data + run, i - run);
+        run = i + 1;
+        switch (c) {
+            case '"': append(arena, builder, "\\\"", 2); break;
+            case '\\': append(arena, builder, "\\\\", 2); break;
+            case '\n': append(arena, builder, "\\n", 2); break;
+            case '\r': append(arena, builder, "\\r", 2); break;
+            case '\t': append(arena, builder, "\\t", 2); break;
+            default: {
+                const char escape[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+                append(arena, builder, escape, sizeof(escape));
+                break;
+            }
+        }
+    }
+    append(arena, builder, text.data + run, text.length - run);
+    append(arena, builder, "\"", 1);
+}
+
+static const u8* render_json(Arena* arena, StringBuilder* builder, const u8* p, const u8* end, i32 depth) {
+    Header h;
+    if (depth > MSGPACK_MAX_DEPTH || !read_header(p, end, &h)) return nullptr;
+    const u8* next = p + h.header;
+    char number[32];
+    switch (h.type) {
+        case MSGPACK_MISSING:
+            return nullptr;
+        case MSGPACK_NIL:
+        case MSGPACK_EXT:
+            append(arena, builder, "null", 4);
+            return skip_value(p, end);
+        case MSGPACK_BOOL:
+            if (h.integer) append(arena, builder, "true", 4);
+            else append(arena, builder, "false", 5);
+            return next;
+        case MSGPACK_INT:
+            append(arena, builder, number, snprintf(number, sizeof(number), "%lld", (long long)h.integer));
+            return next;
+        case MSGPACK_FLOAT:
+            if (!isfinite(h.number)) append(arena, builder, "null", 4);
+            else append(arena, builder, number, snprintf(number, sizeof(number), "%.17g", h.number));
+            return next;
+        case MSGPACK_STR:
+        case MSGPACK_BIN:
+            append_json_string(arena, builder, (String){ .length = h.length, .data = (char*)next });
+            return next + h.length;
+        case MSGPACK_ARRAY:
+            append(arena, builder, "[", 1);
+            for (u64 i = 0; i < h.length && next; i++) {
+                if (i > 0) append(arena, builder, ",", 1);
+                next = render_json(arena, builder, next, end, depth + 1);
+            }
+            append(arena, builder, "]", 1);
+            return next;
+        case MSGPACK_MAP:
+            append(arena, builder, "{", 1);
+            for (u64 i = 0; i < h.length && next; i++) {
+                if (i > 0) append(arena, builder, ",", 1);
+                /* JSON only has string keys, integer keys are quoted and anything else is rendered as its JSON text. */
+                Header key;
+                if (!read_header(next, end, &key)) return nullptr;
+                if (key.type == MSGPACK_INT) {
+                    append(arena, builder, "\"", 1);
+                    next = render_json(arena, builder, next, end, depth + 1);
+                    append(arena, builder, "\"", 1);
+                } else if (key.type == MSGPACK_STR || key.type == MSGPACK_BIN) {
+                    next = render_json(arena, builder, next, end, depth + 1);
+                } else {
+                    const size_t start = builder->buffer.length;
+                    const u8* after = render_json(arena, builder, next, end, depth + 1);
+                    const String text = { .length = builder->buffer.length - start, .data = builder->buffer.data + start };
+                    builder->buffer.length = start;
+                    if (after) append_json_string(arena, builder, StrNewSize(arena, text.data, text.length));
+                    next = after;
+                }
+                if (!next) return nullptr;
+                append(arena, builder, ":", 1);
+                next = render_json(arena, builder, next, end, depth + 1);
+            }
+            append(arena, builder, "}", 1);
+            return next;
+    }
+    return nullptr;
+}
+
+String msgpack_to_json(MsgpackValue value, Arena* arena) {
+    if (!value.data) return (String){0};
+    StringBuilder builder = StringBuilderCreate(arena);
+    if (!render_json(arena, &builder, value.data, value.end, 0)) return (String){0};
+    return builder.buffer;
+}
+
+/* ====== [JSON] ====== */
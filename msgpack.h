@@ -0,0 +1,58 @@
+#pragma once
+#include "include/base.h"
+#include "json.h"
+
+/* A MessagePack reader that works in place, like json.h: a MsgpackValue is the position of a value in the body, maps
+ * are searched with the same JsonKey tables the JSON extractors use, and only the values that are asked for are
+ * decoded. Everything else is skipped by its length prefix without being looked at. */
+
+typedef enum {
+    MSGPACK_MISSING = 0,
+    MSGPACK_NIL,
+    MSGPACK_BOOL,
+    MSGPACK_INT,
+    MSGPACK_FLOAT,
+    MSGPACK_STR,
+    MSGPACK_BIN,
+    MSGPACK_ARRAY,
+    MSGPACK_MAP,
+    MSGPACK_EXT,
+} MsgpackType;
+
+typedef struct {
+    const u8* data;
+    const u8* end;
+} MsgpackValue;
+
+typedef struct {
+    const u8* next;
+    const u8* end;
+    u32 remaining;
+} MsgpackIter;
+
+/* The body has to outlive every value read from it, no NUL terminator is needed. */
+MsgpackValue msgpack_root(String input);
+
+MsgpackType msgpack_type(MsgpackValue value);
+
+/* Looks up several keys of one map in a single pass, keys that are missing come back as MSGPACK_MISSING. */
+void msgpack_fields(MsgpackValue map, const JsonKey* keys, u32 key_count, MsgpackValue* values);
+
+MsgpackValue msgpack_field(MsgpackValue map, const char* key);
+
+MsgpackIter msgpack_iter(MsgpackValue array);
+
+bool msgpack_iter_next(MsgpackIter* iter, MsgpackValue* element);
+
+/* The bytes of a str or bin value, pointing into the body. */
+String msgpack_view(MsgpackValue value);
+
+/* Copied and NUL-terminated in the Arena. Anything that isn't a non-empty str comes back as a null String. */
+String msgpack_string(MsgpackValue value, Arena* arena);
+
+i32 msgpack_i32(MsgpackValue value);
+
+bool msgpack_bool(MsgpackValue value);
+
+/* Renders a value as JSON text in the Arena, bin values become strings and ext values become null. */
+String msgpack_to_json(MsgpackValue value, Arena* arena);
@@ -0,0 +1,239 @@
+#include "pool.h"
+#include <pthread.h>
+#include <time.h>
+#include "database.h"
+
+/* The wait metric is logged this often, whether or not anything waited. */
+#define POOL_REPORT_MS 60000
+
+typedef enum {
+    POOL_IDLE = 0,
+    POOL_LEASED,
+    POOL_CHECKING,
+    POOL_BROKEN,
+} PoolSlotState;
+
+/* Cumulative since the pool was created. A checkout that found no idle connection counts as a wait. */
+typedef struct {
+    u64 checkouts;
+    u64 waits;
+    u64 timeouts;
+    u64 wait_total_us;
+    u64 wait_max_us;
+    u64 replaced;
+    i32 size;
+    i32 idle;
+} DbPoolStats;
+
+typedef struct {
+    PGconn* conn;
+    PoolSlotState state;
+    i64 checked_ms;
+} PoolSlot;
+
+struct DbPool {
+    char* db_url;
+    i32 size;
+    i32 health_interval_ms;
+    PoolSlot* slots;
+    pthread_mutex_t lock;
+    /* Signalled when a slot turns idle, for threads waiting in db_pool_acquire. */
+    pthread_cond_t available;
+    /* Signalled when a slot breaks or the pool shuts down, for the health thread. */
+    pthread_cond_t wake;
+    pthread_t health;
+    bool health_started;
+    bool stopping;
+    DbPoolStats stats;
+};
+
+static u64 monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + (u64)ts.tv_nsec / 1000;
+}
+
+/* Both condition variables run on the monotonic clock, a wall clock change must not stretch or cut a wait. */
+static struct timespec deadline_after(i64 ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+static bool pool_ping(PGconn* conn) {
+    PGresult* res = PQexec(conn, "SELECT 1");
+    const bool ok = res && PQresultStatus(res) == PGRES_TUPLES_OK;
+    if (res) PQclear(res);
+    return ok;
+}
+
+/* Called with the lock held, or once nothing else uses the pool. */
+static void pool_count_idle(DbPool* pool) {
+    pool->stats.idle = 0;
+    for (i32 i = 0; i < pool->size; i++) pool->stats.idle += pool->slots[i].state == POOL_IDLE;
+}
+
+static void pool_report(DbPool* pool) {
+    pool_count_idle(pool);
+    const DbPoolStats* stats = &pool->stats;
+    const f64 average_ms = stats->waits ? (f64)stats->wait_total_us / (f64)stats->waits / 1000.0 : 0.0;
+    LogInfo("DbPool: %d/%d idle, %llu checkouts, %llu waited (avg %.2f ms, max %.2f ms), %llu timed out, %llu replaced.",
+            stats->idle, stats->size, (unsigned long long)stats->checkouts, (unsigned long long)stats->waits, average_ms,
+            (f64)stats->wait_max_us / 1000.0, (unsigned long long)stats->timeouts, (unsigned long long)stats->replaced);
+}
+
+/* Connecting and pinging happen without the lock, the slot's state keeps everyone else off it meanwhile. Broken slots
+ * are retried every interval, or right away when a release wakes the thread. */
+static void* pool_health_run(void* arg) {
+    DbPool* pool = arg;
+    i64 reported_ms = TimeNow();
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping) {
+        const struct timespec deadline = deadline_after(pool->health_interval_ms);
+        pthread_cond_timedwait(&pool->wake, &pool->lock, &deadline);
+        for (i32 i = 0; i < pool->size && !pool->stopping; i++) {
+            PoolSlot* slot = &pool->slots[i];
+            if (slot->state == POOL_IDLE && TimeNow() - slot->checked_ms >= pool->health_interval_ms) {
+                slot->state = POOL_CHECKING;
+                pthread_mutex_unlock(&pool->lock);
+                const bool ok = pool_ping(slot->conn);
+                pthread_mutex_lock(&pool->lock);
+                if (ok) {
+                    slot->state = POOL_IDLE;
+                    slot->checked_ms = TimeNow();
+                    pthread_cond_signal(&pool->available);
+                } else {
+                    LogWarn("DbPool: Connection %d failed its health check.", i);
+                    slot->state = POOL_BROKEN;
+                }
+            }
+            if (slot->state == POOL_BROKEN) {
+                PGconn* old = slot->conn;
+                slot->conn = nullptr;
+                pthread_mutex_unlock(&pool->lock);
+                if (old) PQfinish(old);
+                PGconn* fresh = connect_db(pool->db_url);
+                pthread_mutex_lock(&pool->lock);
+                if (fresh) {
+                    slot->conn = fresh;
+                    slot->state = POOL_IDLE;
+                    slot->checked_ms = TimeNow();
+                    pool->stats.replaced++;
+                    pthread_cond_signal(&pool->available);
+                }
+            }
+        }
+        if (TimeNow() - reported_ms >= POOL_REPORT_MS) {
+            reported_ms = TimeNow();
+            pool_report(pool);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return nullptr;
+}
+
+DbPool* db_pool_new(const char* db_url, i32 size, i32 health_interval_ms) {
+    DbPool* pool = Malloc(sizeof(DbPool));
+    *pool = (DbPool){0};
+    pool->db_url = strdup(db_url);
+    pool->size = size > 0 ? size : 1;
+    pool->health_interval_ms = health_interval_ms > 0 ? health_interval_ms : 1;
+    pool->slots = Malloc(sizeof(PoolSlot) * pool->size);
+    pool->stats.size = pool->size;
+
+    pthread_condattr_t monotonic;
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_mutex_init(&pool->lock, nullptr);
+    pthread_cond_init(&pool->available, &monotonic);
+    pthread_cond_init(&pool->wake, &monotonic);
+    pthread_condattr_destroy(&monotonic);
+
+    for (i32 i = 0; i < pool->size; i++) {
+        PGconn* conn = connect_db(pool->db_url);
+        pool->slots[i] = (PoolSlot){ .conn = conn, .state = conn ? POOL_IDLE : POOL_BROKEN, .checked_ms = TimeNow() };
+    }
+    pool->health_started = pthread_create(&pool->health, nullptr, pool_health_run, pool) == 0;
+    if (!pool->health_started) LogError("DbPool: Couldn't start the health thread, broken connections won't be replaced.");
+    return pool;
+}
+
+PGconn* db_pool_acquire(DbPool* pool, i32 timeout_ms) {
+    const u64 started = monotonic_us();
+    const struct timespec deadline = deadline_after(timeout_ms);
+    PGconn* conn = nullptr;
+    bool waited = false;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping) {
+        for (i32 i = 0; i < pool->size; i++) {
+            if (pool->slots[i].state != POOL_IDLE) continue;
+            pool->slots[i].state = POOL_LEASED;
+            conn = pool->slots[i].conn;
+            break;
+        }
+        if (conn) break;
+        waited = true;
+        if (pthread_cond_timedwait(&pool->available, &pool->lock, &deadline) == ETIMEDOUT) break;
+    }
+    DbPoolStats* stats = &pool->stats;
+    if (conn) stats->checkouts++;
+    else stats->timeouts++;
+    if (waited) {
+        const u64 elapsed = monotonic_us() - started;
+        stats->waits++;
+        stats->wait_total_us += elapsed;
+        stats->wait_max_us = Max(stats->wait_max_us, elapsed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!conn) LogWarn("DbPool: No connection became free within %d ms.", timeout_ms);
+    return conn;
+}
+
+void db_pool_release(DbPool* pool, PGconn* conn, bool broken) {
+    if (!conn) return;
+    broken = broken || PQstatus(conn) != CONNECTION_OK || PQtransactionStatus(conn) != PQTRANS_IDLE;
+    pthread_mutex_lock(&pool->lock);
+    for (i32 i = 0; i < pool->size; i++) {
+        PoolSlot* slot = &pool->slots[i];
+        if (slot->conn != conn) continue;
+        if (broken) {
+            slot->state = POOL_BROKEN;
+            pthread_cond_signal(&pool->wake);
+        } else {
+            slot->state = POOL_IDLE;
+            slot->checked_ms = TimeNow();
+            pthread_cond_signal(&pool->available);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void db_pool_free(DbPool* pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->available);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    if (pool->health_started) pthread_join(pool->health, nullptr);
+
+    pool_report(pool);
+    for (i32 i = 0; i < pool->size; i++) {
+        if (pool->slots[i].conn) PQfinish(pool->slots[i].conn);
+    }
+    pthread_cond_destroy(&pool->available);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    Free(pool->slots);
+    free(pool->db_url);
+    Free(pool);
+}
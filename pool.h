@@ -0,0 +1,22 @@
+#pragma once
+#include "include/base.h"
+#include <libpq-fe.h>
+
+/* A DbPool is a fixed set of Postgres connections, opened with connect_db, that threads lease one at a time for as
+ * long as one unit of work takes. Its size is set on its own, so adding consumer threads doesn't add connections.
+ * A health thread pings connections that sat idle for a whole interval and reopens the ones that broke, callers only
+ * ever see a connection that is up or a timeout. Its wait metrics are logged every minute and when it is freed. */
+
+typedef struct DbPool DbPool;
+
+/* Connections that can't be opened right away are left to the health thread. */
+DbPool* db_pool_new(const char* db_url, i32 size, i32 health_interval_ms);
+
+/* Blocks until a connection is free, nullptr once timeout_ms passed or the pool is shutting down. */
+PGconn* db_pool_acquire(DbPool* pool, i32 timeout_ms);
+
+/* A connection handed back as broken, found broken, or left inside a transaction is replaced instead of reused. */
+void db_pool_release(DbPool* pool, PGconn* conn, bool broken);
+
+/* Every connection has to be released first. */
+void db_pool_free(DbPool* pool);
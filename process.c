@@ -1,52 +1,331 @@
 #include "process.h"
 #include "include/base.h"
 #include <string.h>
+#include <strings.h>
 #include "library.h"
 #include "database.h"
 #include "api.h"
 
-void process_outgoing(char* data, PGconn* client, redisContext* conn, Arena* arena) {
-    if (!data || !client || !arena) {
-        LogError("process_outgoing: Invalid arguments (data, client, or arena is NULL)");
-        return;
-    }
-    if (strstr(data, "upsertChat") != nullptr) {
-        LogInfo("Starting UpsertChat process...");
-        Chat chat = parse_chat_from_json(arena, data);
-        if (StrIsNull(chat.situation)) {
-            LogError("UpsertChat: Failed to parse chat from JSON: %s", data);
-            return;
-        }
-        upsert_chats(client, &chat);
-        LogSuccess("UpsertChat process completed.");
-    } else if (strstr(data, "upsertCustomer") != nullptr) {
-        LogInfo("Starting UpsertCustomer process...");
-        Customer customer = parse_customer_from_json(arena, data);
-        if (StrIsNull(customer.name)) {
-            LogError("UpsertCustomer: Failed to parse customer from JSON: %s", data);
-            return;
+/* ====== [ROUTING] ====== */
+
+/* The root of an outgoing message in whichever format it arrived in, the decoders pick the matching extractor. */
+typedef struct {
+    PayloadFormat format;
+    union {
+        JsonValue json;
+        MsgpackValue msgpack;
+    };
+} Payload;
+
+static void log_payload(const char* what, const Payload* root, String data) {
+    if (root->format == PAYLOAD_MSGPACK) LogError("%s: %zu bytes of msgpack", what, data.length);
+    else LogError("%s: %.*s", what, (int)data.length, data.data);
+}
+
+static bool decode_chat(const Payload* root, String data, Arena* arena, OutgoingOperation* operation) {
+    LogInfo("Starting UpsertChat process...");
+    operation->chat = root->format == PAYLOAD_MSGPACK ? chat_from_msgpack(arena, root->msgpack) : chat_from_json(arena, root->json);
+    if (!operation->chat.situation) {
+        log_payload("UpsertChat: Failed to parse chat", root, data);
+        return false;
+    }
+    return true;
+}
+
+static bool decode_customer(const Payload* root, String data, Arena* arena, OutgoingOperation* operation) {
+    LogInfo("Starting UpsertCustomer process...");
+    operation->customer = root->format == PAYLOAD_MSGPACK ? customer_from_msgpack(arena, root->msgpack) : customer_from_json(arena, root->json);
+    if (StrIsNull(operation->customer.name)) {
+        log_payload("UpsertCustomer: Failed to parse customer", root, data);
+        return false;
+    }
+    return true;
+}
+
+static bool decode_message(const Payload* root, String data, Arena* arena, OutgoingOperation* operation) {
+    LogInfo("Starting UpsertMessage process...");
+    operation->message = root->format == PAYLOAD_MSGPACK ? message_from_msgpack(arena, root->msgpack) : message_from_json(arena, root->json);
+    if (StrIsNull(operation->message.from) || StrIsNull(operation->message.to)) {
+        log_payload("UpsertMessage: Failed to parse message", root, data);
+        return false;
+    }
+    return true;
+}
+
+static bool decode_request(const Payload* root, String data, Arena* arena, OutgoingOperation* operation) {
+    LogInfo("Starting SendRequest process...");
+    operation->request = root->format == PAYLOAD_MSGPACK ? request_from_msgpack(arena, root->msgpack) : request_from_json(arena, root->json);
+    if (!operation->request.action || !operation->request.method || StrIsNull(operation->request.url)) {
+        log_payload("SendRequest: Failed to parse request", root, data);
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    const char* name;
+    u32 length;
+    OutgoingAction action;
+    bool (*decode)(const Payload* root, String data, Arena* arena, OutgoingOperation* operation);
+} ActionRoute;
+
+/* Perfect hash over the known action names: length and last character are enough to tell them apart.
+ * A new action that collides shows up as an overridden initializer, which -Wextra -Werror rejects. */
+#define ACTION_ROUTE_SLOTS 8
+#define ACTION_SLOT(length, last) ((((u32)(length)) * 2 + (u8)(last)) & (ACTION_ROUTE_SLOTS - 1))
+#define ACTION_ROUTE(literal, last, kind, decoder) \
+    [ACTION_SLOT(sizeof(literal) - 1, last)] = { literal, sizeof(literal) - 1, kind, decoder }
+
+static const ActionRoute action_routes[ACTION_ROUTE_SLOTS] = {
+    ACTION_ROUTE("upsertChat", 't', OUTGOING_UPSERT_CHAT, decode_chat),
+    ACTION_ROUTE("upsertCustomer", 'r', OUTGOING_UPSERT_CUSTOMER, decode_customer),
+    ACTION_ROUTE("sendMessage", 'e', OUTGOING_SEND_MESSAGE, decode_message),
+    ACTION_ROUTE("sendRequest", 't', OUTGOING_SEND_REQUEST, decode_request),
+};
+
+static const ActionRoute* route_action(String name) {
+    if (StrIsNull(name) || name.length == 0) return nullptr;
+    const ActionRoute* route = &action_routes[ACTION_SLOT(name.length, name.data[name.length - 1])];
+    if (!route->name || route->length != name.length || memcmp(route->name, name.data, name.length) != 0) return nullptr;
+    return route;
+}
+
+/* Action names never need unescaping, so the raw text between the quotes is compared in place. */
+static String json_action(JsonValue root) {
+    const JsonValue action = json_field(root, "action");
+    if (json_type(action) != JSON_STRING) return (String){0};
+    const String raw = json_raw(action);
+    return (String){ .length = raw.length - 2, .data = raw.data + 1 };
+}
+
+static String msgpack_action(MsgpackValue root) {
+    const MsgpackValue action = msgpack_field(root, "action");
+    return msgpack_type(action) == MSGPACK_STR ? msgpack_view(action) : (String){0};
+}
+
+/* ====== [ROUTING] ====== */
+
+static bool decode_operation(const Payload* root, String data, Arena* arena, OutgoingOperation* operation) {
+    const String action = root->format == PAYLOAD_MSGPACK ? msgpack_action(root->msgpack) : json_action(root->json);
+    const ActionRoute* route = route_action(action);
+    if (!route) {
+        log_payload("Unknown message type. Message content", root, data);
+        return false;
+    }
+    operation->action = route->action;
+    return route->decode(root, data, arena, operation);
+}
+
+/* Every operation of an envelope has to decode, a unit that is only partly valid is rejected as a whole. */
+static bool decode_envelope(const Payload* root, String data, Arena* arena, OutgoingBatch* batch) {
+    JsonIter json = {0};
+    MsgpackIter msgpack = {0};
+    if (root->format == PAYLOAD_MSGPACK) {
+        msgpack = msgpack_iter(root->msgpack);
+        batch->count = msgpack.remaining <= data.length ? (i32)msgpack.remaining : -1;
+    } else {
+        json = json_iter(root->json);
+        JsonValue element;
+        for (JsonIter count = json; json_iter_next(&count, &element);) batch->count++;
+    }
+    if (batch->count <= 0) {
+        log_payload("Envelope without a valid operation count", root, data);
+        return false;
+    }
+    batch->operations = ArenaAlloc(arena, sizeof(OutgoingOperation) * batch->count);
+    for (i32 i = 0; i < batch->count; i++) {
+        Payload element = { .format = root->format };
+        const bool next = root->format == PAYLOAD_MSGPACK ? msgpack_iter_next(&msgpack, &element.msgpack)
+                                                          : json_iter_next(&json, &element.json);
+        const bool is_object = root->format == PAYLOAD_MSGPACK ? msgpack_type(element.msgpack) == MSGPACK_MAP
+                                                               : json_type(element.json) == JSON_OBJECT;
+        if (!next || !is_object) {
+            LogError("Envelope operation %d isn't an object.", i);
+            return false;
         }
-        upsert_customer(client, &customer);
-        LogSuccess("UpsertCustomer process completed.");
-    } else if (strstr(data, "sendMessage") != nullptr) {
-        LogInfo("Starting UpsertMessage process...");
-        Message message = parse_message_from_json(arena, data);
-        if (StrIsNull(message.from) || StrIsNull(message.to)) {
-            LogError("UpsertMessage: Failed to parse message from JSON: %s", data);
-            return;
+        if (!decode_operation(&element, data, arena, &batch->operations[i])) return false;
+    }
+    return true;
+}
+
+/* Anything that doesn't say it's MessagePack is read as JSON, which is what every producer sent before. */
+PayloadFormat payload_format(String content_type) {
+    static const char* const msgpack_types[] = { "application/msgpack", "application/x-msgpack", "application/vnd.msgpack" };
+    if (StrIsNull(content_type)) return PAYLOAD_JSON;
+    size_t length = content_type.length;
+    const char* parameters = memchr(content_type.data, ';', length);
+    if (parameters) length = parameters - content_type.data;
+    while (length > 0 && content_type.data[length - 1] == ' ') length--;
+    for (size_t i = 0; i < sizeof(msgpack_types) / sizeof(msgpack_types[0]); i++) {
+        if (strlen(msgpack_types[i]) == length && strncasecmp(msgpack_types[i], content_type.data, length) == 0) {
+            return PAYLOAD_MSGPACK;
         }
-        upsert_messages(client, &message);
-        LogSuccess("UpsertMessage process completed.");
-    } else if (strstr(data, "sendRequest") != nullptr) {
-        LogInfo("Starting SendRequest process...");
-        Request req = parse_request_from_json(arena, data);
-        if (StrIsNull(req.action) || StrIsNull(req.method) || StrIsNull(req.url)) {
-            LogError("SendRequest: Failed to parse request from JSON: %s", data);
-            return;
+    }
+    return PAYLOAD_JSON;
+}
+
+/* The body is read exactly once, routing and the typed extractors walk the same JSON index or MessagePack body, and
+ * everything they copy goes away with the next ArenaReset. The body is not NUL-terminated, it points straight into
+ * the AMQP frame buffer. */
+bool decode_outgoing(String data, PayloadFormat format, Arena* arena, OutgoingBatch* batch) {
+    *batch = (OutgoingBatch){0};
+    Payload root = { .format = format };
+    JsonDoc doc;
+    bool is_envelope;
+    if (format == PAYLOAD_MSGPACK) {
+        root.msgpack = msgpack_root(data);
+        const MsgpackType type = msgpack_type(root.msgpack);
+        if (type != MSGPACK_MAP && type != MSGPACK_ARRAY) {
+            LogError("Couldn't parse message as a msgpack map or array (%zu bytes)", data.length);
+            return false;
         }
-        make_request(&req, arena);
-        LogSuccess("SendRequest process completed.");
+        is_envelope = type == MSGPACK_ARRAY;
     } else {
-        LogWarn("Unknown message type. Message content: %s", data);
+        root.json = json_index(arena, data, &doc) ? json_root(&doc) : (JsonValue){0};
+        const JsonType type = json_type(root.json);
+        if (type != JSON_OBJECT && type != JSON_ARRAY) {
+            LogError("Couldn't parse message as a JSON object or array: %.*s", (int)data.length, data.data);
+            return false;
+        }
+        is_envelope = type == JSON_ARRAY;
+    }
+    if (is_envelope) return decode_envelope(&root, data, arena, batch);
+    batch->operations = ArenaAlloc(arena, sizeof(OutgoingOperation));
+    batch->count = 1;
+    return decode_operation(&root, data, arena, batch->operations);
+}
+
+static ProcessStatus db_process_status(DbStatus status) {
+    switch (status) {
+        case DB_OK: return PROCESS_OK;
+        case DB_QUERY_FAILED: return PROCESS_FAILED;
+        case DB_CONNECTION_LOST: return PROCESS_RETRY;
+    }
+    return PROCESS_FAILED;
+}
+
+/* PROCESS_INVALID messages can never succeed, PROCESS_FAILED ones were rejected by their sink
+ * and PROCESS_RETRY ones never reached it because the connection is gone. */
+static ProcessStatus execute_operation(OutgoingOperation* operation, PGconn* client, Arena* arena) {
+    ProcessStatus status = PROCESS_INVALID;
+    switch (operation->action) {
+        case OUTGOING_UPSERT_CHAT:
+            status = db_process_status(upsert_chats(client, &operation->chat));
+            if (status == PROCESS_OK) LogSuccess("UpsertChat process completed.");
+            break;
+        case OUTGOING_UPSERT_CUSTOMER:
+            status = db_process_status(upsert_customer(client, &operation->customer));
+            if (status == PROCESS_OK) LogSuccess("UpsertCustomer process completed.");
+            break;
+        case OUTGOING_SEND_MESSAGE:
+            status = db_process_status(upsert_messages(client, &operation->message));
+            if (status == PROCESS_OK) LogSuccess("UpsertMessage process completed.");
+            break;
+        case OUTGOING_SEND_REQUEST:
+            status = make_request(&operation->request, arena) ? PROCESS_OK : PROCESS_FAILED;
+            if (status == PROCESS_OK) LogSuccess("SendRequest process completed.");
+            break;
+        case OUTGOING_UNKNOWN:
+            break;
+    }
+    return status;
+}
+
+bool outgoing_request_done(const OutgoingBatch* batch, i32 index) {
+    return index < OUTGOING_TRACKED_REQUESTS && (batch->requests_done >> index & 1);
+}
+
+void outgoing_mark_request_done(OutgoingBatch* batch, i32 index) {
+    if (index < OUTGOING_TRACKED_REQUESTS) batch->requests_done |= 1ULL << index;
+}
+
+/* The DB writes of an envelope commit or roll back together, its HTTP requests can't be taken back so they only go out
+ * once those writes are committed. A failed envelope is retried with all of its writes, upserts are idempotent, but
+ * only with the requests that didn't succeed yet. */
+ProcessStatus execute_outgoing(OutgoingBatch* batch, PGconn* client, Arena* arena) {
+    if (batch->count == 1) return execute_operation(batch->operations, client, arena);
+    i32 writes = 0;
+    for (i32 i = 0; i < batch->count; i++) {
+        if (batch->operations[i].action != OUTGOING_SEND_REQUEST) writes++;
+    }
+    ProcessStatus status = PROCESS_OK;
+    if (writes > 0) {
+        status = db_process_status(db_command(client, "BEGIN"));
+        for (i32 i = 0; i < batch->count && status == PROCESS_OK; i++) {
+            if (batch->operations[i].action == OUTGOING_SEND_REQUEST) continue;
+            status = execute_operation(&batch->operations[i], client, arena);
+        }
+        if (status == PROCESS_OK) status = db_process_status(db_command(client, "COMMIT"));
+        else if (status != PROCESS_RETRY) db_command(client, "ROLLBACK");
+    }
+    for (i32 i = 0; i < batch->count && status == PROCESS_OK; i++) {
+        if (batch->operations[i].action != OUTGOING_SEND_REQUEST || outgoing_request_done(batch, i)) continue;
+        status = execute_operation(&batch->operations[i], client, arena);
+        if (status == PROCESS_OK) outgoing_mark_request_done(batch, i);
+    }
+    if (status == PROCESS_OK) LogSuccess("Envelope of %d operations completed.", batch->count);
+    return status;
+}
+
+bool outgoing_stageable(const OutgoingBatch* batch, const DbBatch* upserts, i32 capacity) {
+    if (db_batch_rows(upserts) + batch->count > capacity) return false;
+    for (i32 i = 0; i < batch->count; i++) {
+        const OutgoingAction action = batch->operations[i].action;
+        if (action == OUTGOING_SEND_REQUEST || action == OUTGOING_UNKNOWN) return false;
+    }
+    return true;
+}
+
+ProcessStatus stage_outgoing(const OutgoingBatch* batch, DbBatch* upserts) {
+    for (i32 i = 0; i < batch->count; i++) {
+        const OutgoingOperation* operation = &batch->operations[i];
+        bool added = false;
+        switch (operation->action) {
+            case OUTGOING_UPSERT_CHAT:
+                added = db_batch_add_chat(upserts, &operation->chat);
+                break;
+            case OUTGOING_UPSERT_CUSTOMER:
+                added = db_batch_add_customer(upserts, &operation->customer);
+                break;
+            case OUTGOING_SEND_MESSAGE:
+                added = db_batch_add_message(upserts, &operation->message);
+                break;
+            case OUTGOING_SEND_REQUEST:
+            case OUTGOING_UNKNOWN:
+                break;
+        }
+        if (!added) {
+            LogError("Staging operation %d of %d failed, the DbBatch refused its row.", i, batch->count);
+            return PROCESS_RETRY;
+        }
+    }
+    return PROCESS_OK;
+}
+
+ProcessStatus process_outgoing(String data, PayloadFormat format, PGconn* client, Arena* arena) {
+    if (StrIsNull(data) || !client || !arena) {
+        LogError("process_outgoing: Invalid arguments (data, client, or arena is NULL)");
+        return PROCESS_INVALID;
+    }
+    OutgoingBatch batch;
+    if (!decode_outgoing(data, format, arena, &batch)) {
+        return PROCESS_INVALID;
+    }
+    return execute_outgoing(&batch, client, arena);
+}
+
+/* Incoming webhooks are only parsed here, the Redis writes happen when the worker flushes the batch. */
+bool process_incoming(String data, u64 delivery_tag, RedisBatch* batch) {
+    if (StrIsNull(data) || !batch) {
+        LogError("process_incoming: Invalid arguments (data or batch is NULL)");
+        return false;
+    }
+    const Webhook webhook = parse_webhook_from_json(batch->arena, data);
+    if (StrIsNull(webhook.message_remotejid) || StrIsNull(webhook.message)) {
+        LogWarn("Incoming: Skipping webhook without a message: %.*s", (int)data.length, data.data);
+        return false;
     }
+    addMessageToBatch(batch, webhook.message_remotejid, webhook.message_remotejid, webhook.apikey, webhook.message,
+                      delivery_tag);
+    return true;
 }
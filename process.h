@@ -1,8 +1,73 @@
 #pragma once
 
+#include "include/base.h"
 #include <libpq-fe.h>
 #include <hiredis/hiredis.h>
+#include "library.h"
+#include "database.h"
+#include "redis.h"
 
-void process_outgoing(char* data, PGconn* client, redisContext* conn);
+typedef enum {
+    OUTGOING_UNKNOWN = 0,
+    OUTGOING_UPSERT_CHAT,
+    OUTGOING_UPSERT_CUSTOMER,
+    OUTGOING_SEND_MESSAGE,
+    OUTGOING_SEND_REQUEST,
+} OutgoingAction;
 
-void process_incoming(char* data, PGconn* client, redisContext* conn);
+/* An OutgoingOperation is a routed and parsed outgoing message that hasn't reached its sink yet. */
+typedef struct {
+    OutgoingAction action;
+    union {
+        Chat chat;
+        Customer customer;
+        Message message;
+        Request request;
+    };
+} OutgoingOperation;
+
+/* Requests can't be taken back, so an envelope remembers which of its requests went out and a retry only sends the
+ * rest. Operations past this index are sent again on every retry. */
+#define OUTGOING_TRACKED_REQUESTS 64
+
+/* An OutgoingBatch is every operation one delivery carries: a single one, or all of them for an envelope, whose body
+ * is an array of operations that are processed, and acknowledged, as one unit. Bit i of requests_done is set once
+ * operation i, a request, succeeded, the consumer loads it from the delivery and reject_delivery carries it over. */
+typedef struct {
+    OutgoingOperation* operations;
+    i32 count;
+    u64 requests_done;
+} OutgoingBatch;
+
+typedef enum {
+    PROCESS_OK = 0,
+    PROCESS_INVALID,
+    PROCESS_FAILED,
+    PROCESS_RETRY,
+} ProcessStatus;
+
+typedef enum {
+    PAYLOAD_JSON = 0,
+    PAYLOAD_MSGPACK,
+} PayloadFormat;
+
+PayloadFormat payload_format(String content_type);
+
+bool decode_outgoing(String data, PayloadFormat format, Arena* arena, OutgoingBatch* batch);
+
+bool outgoing_request_done(const OutgoingBatch* batch, i32 index);
+
+void outgoing_mark_request_done(OutgoingBatch* batch, i32 index);
+
+ProcessStatus execute_outgoing(OutgoingBatch* batch, PGconn* client, Arena* arena);
+
+/* Whether stage_outgoing can take a batch: it makes no HTTP requests and the DbBatch has room for all of its rows. */
+bool outgoing_stageable(const OutgoingBatch* batch, const DbBatch* upserts, i32 capacity);
+
+/* Adds every row of a batch to the DbBatch instead of writing it. PROCESS_RETRY when the DbBatch refused a row, the
+ * rows before it are already staged then and the delivery has to be retried. */
+ProcessStatus stage_outgoing(const OutgoingBatch* batch, DbBatch* upserts);
+
+ProcessStatus process_outgoing(String data, PayloadFormat format, PGconn* client, Arena* arena);
+
+bool process_incoming(String data, u64 delivery_tag, RedisBatch* batch);
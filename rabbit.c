@@ -49,35 +49,576 @@ amqp_connection_state_t connect_rabbitmq(Dotenv *env) {
     amqp_socket_t *socket = amqp_tcp_socket_new(conn);
     if (!socket) {
         fprintf(stderr, "Creating TCP socket failed\n");
+        amqp_destroy_connection(conn);
         return nullptr;
     }
     if (amqp_socket_open(socket, host, port)) {
         fprintf(stderr, "Opening TCP socket failed\n");
+        amqp_destroy_connection(conn);
         return nullptr;
     }
     amqp_rpc_reply_t login_reply = amqp_login(
-        conn, vhost, 0, 131072, 0,
+        conn, vhost, env->amqp_channel_max, env->amqp_frame_max, env->amqp_heartbeat,
         AMQP_SASL_METHOD_PLAIN, user, pass
     );
     if (login_reply.reply_type != AMQP_RESPONSE_NORMAL) {
         fprintf(stderr, "RabbitMQ login failed\n");
+        amqp_destroy_connection(conn);
         return nullptr;
     }
+    LogInfo("RabbitMQ negotiated frame_max=%d channel_max=%d heartbeat=%ds",
+            amqp_get_frame_max(conn), amqp_get_channel_max(conn), amqp_get_heartbeat(conn));
     return conn;
 }
 
 amqp_connection_state_t create_rabbitmq_consumer(Dotenv *env, const char *queue_name) {
     amqp_connection_state_t conn = connect_rabbitmq(env);
     if (!conn) return nullptr;
-    amqp_channel_open(conn, 1);
+    amqp_channel_open(conn, RABBIT_CHANNEL);
     if (amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL) {
         fprintf(stderr, "Opening channel failed\n");
+        amqp_destroy_connection(conn);
         return nullptr;
     }
-    amqp_basic_consume(conn, 1, amqp_cstring_bytes(queue_name), amqp_cstring_bytes("WasolConsumer"), 0, 1, 0, amqp_empty_table);
+    amqp_basic_qos(conn, RABBIT_CHANNEL, 0, (u16)env->prefetch_count, 0);
+    if (amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL) {
+        fprintf(stderr, "Setting prefetch count failed\n");
+        amqp_destroy_connection(conn);
+        return nullptr;
+    }
+    amqp_basic_consume(conn, RABBIT_CHANNEL, amqp_cstring_bytes(queue_name), amqp_cstring_bytes("WasolConsumer"), 0, 0, 0, amqp_empty_table);
     if (amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL) {
         fprintf(stderr, "Basic consume failed\n");
+        amqp_destroy_connection(conn);
         return nullptr;
     }
     return conn;
 }
+
+void close_rabbitmq(amqp_connection_state_t conn) {
+    if (!conn) return;
+    amqp_channel_close(conn, RABBIT_CHANNEL, AMQP_REPLY_SUCCESS);
+    amqp_connection_close(conn, AMQP_REPLY_SUCCESS);
+    amqp_destroy_connection(conn);
+}
+
+/* For connections that already failed: no close handshake, the broker requeues whatever was left unacknowledged. */
+void drop_rabbitmq(amqp_connection_state_t conn) {
+    if (!conn) return;
+    amqp_destroy_connection(conn);
+}
+
+bool requeue_delivery(amqp_connection_state_t conn, u64 delivery_tag) {
+    const int status = amqp_basic_nack(conn, RABBIT_CHANNEL, delivery_tag, 0, 1);
+    if (status != AMQP_STATUS_OK) {
+        LogError("Requeue of delivery %" PRIu64 " failed: %s", delivery_tag, amqp_error_string2(status));
+        return false;
+    }
+    return true;
+}
+
+static int wait_content_frame(amqp_connection_state_t conn, amqp_frame_t* frame, u8 frame_type) {
+    const int status = amqp_simple_wait_frame(conn, frame);
+    if (status != AMQP_STATUS_OK) return status;
+    if (frame->frame_type != frame_type || frame->channel != RABBIT_CHANNEL) return AMQP_STATUS_UNEXPECTED_FRAME;
+    return AMQP_STATUS_OK;
+}
+
+int read_delivery(amqp_connection_state_t conn, Arena* arena, Delivery* delivery, const struct timeval* timeout) {
+    amqp_frame_t frame;
+    while (true) {
+        const int status = amqp_simple_wait_frame_noblock(conn, &frame, timeout);
+        if (status != AMQP_STATUS_OK) return status;
+        if (frame.frame_type != AMQP_FRAME_METHOD) return AMQP_STATUS_UNEXPECTED_FRAME;
+        const amqp_method_number_t method = frame.payload.method.id;
+        if (method == AMQP_BASIC_DELIVER_METHOD) break;
+        if (method == AMQP_CHANNEL_CLOSE_METHOD || method == AMQP_CONNECTION_CLOSE_METHOD) {
+            const amqp_channel_close_t* close = frame.payload.method.decoded;
+            LogError("RabbitMQ closed the %s: %.*s", method == AMQP_CHANNEL_CLOSE_METHOD ? "channel" : "connection",
+                     (int)close->reply_text.len, (char*)close->reply_text.bytes);
+            return AMQP_STATUS_CONNECTION_CLOSED;
+        }
+        LogWarn("Ignoring unexpected AMQP method 0x%08x", method);
+    }
+
+    const amqp_basic_deliver_t* deliver = frame.payload.method.decoded;
+    *delivery = (Delivery){ .delivery_tag = deliver->delivery_tag, .redelivered = deliver->redelivered };
+
+    int status = wait_content_frame(conn, &frame, AMQP_FRAME_HEADER);
+    if (status != AMQP_STATUS_OK) return status;
+    delivery->properties = frame.payload.properties.decoded;
+    const size_t body_size = frame.payload.properties.body_size;
+    if (body_size == 0) {
+        delivery->body = (String){ .length = 0, .data = "" };
+        return AMQP_STATUS_OK;
+    }
+
+    status = wait_content_frame(conn, &frame, AMQP_FRAME_BODY);
+    if (status != AMQP_STATUS_OK) return status;
+    if (frame.payload.body_fragment.len == body_size) {
+        delivery->body = (String){ .length = body_size, .data = frame.payload.body_fragment.bytes };
+        delivery->body_in_frame = true;
+        return AMQP_STATUS_OK;
+    }
+
+    /* Multi-frame bodies are copied exactly once, into a single allocation sized from the content header. */
+    char* body = ArenaAllocChars(arena, body_size + 1);
+    size_t received = 0;
+    while (true) {
+        const amqp_bytes_t fragment = frame.payload.body_fragment;
+        if (fragment.len > body_size - received) return AMQP_STATUS_BAD_AMQP_DATA;
+        memcpy(body + received, fragment.bytes, fragment.len);
+        received += fragment.len;
+        if (received == body_size) break;
+        status = wait_content_frame(conn, &frame, AMQP_FRAME_BODY);
+        if (status != AMQP_STATUS_OK) return status;
+    }
+    body[body_size] = '\0';
+    delivery->body = (String){ .length = body_size, .data = body };
+    return AMQP_STATUS_OK;
+}
+
+/* ====== [RETRY] ====== */
+
+#define ATTEMPTS_HEADER "x-attempts"
+#define REQUESTS_DONE_HEADER "x-requests-done"
+#define PUBLISH_CONFIRM_MS 5000
+
+static amqp_bytes_t copy_bytes(amqp_bytes_t bytes, Arena* arena) {
+    if (bytes.len == 0) return amqp_empty_bytes;
+    void* copy = ArenaAlloc(arena, bytes.len);
+    memcpy(copy, bytes.bytes, bytes.len);
+    return (amqp_bytes_t){ .len = bytes.len, .bytes = copy };
+}
+
+static bool header_is(const amqp_table_entry_t* entry, const char* name) {
+    return entry->key.len == strlen(name) && memcmp(entry->key.bytes, name, entry->key.len) == 0;
+}
+
+/* Not NUL-terminated, it points into the delivery's properties. */
+String delivery_content_type(const Delivery* delivery) {
+    const amqp_basic_properties_t* properties = delivery->properties;
+    if (!properties || !(properties->_flags & AMQP_BASIC_CONTENT_TYPE_FLAG)) return (String){0};
+    return (String){ .length = properties->content_type.len, .data = properties->content_type.bytes };
+}
+
+/* Copies the body and the properties a republish needs out of librabbitmq's frame buffers, so the delivery
+ * outlives amqp_maybe_release_buffers. Nested header tables and arrays are not carried over. */
+void detach_delivery(Delivery* delivery, Arena* arena) {
+    if (delivery->body_in_frame) {
+        char* body = ArenaAllocChars(arena, delivery->body.length + 1);
+        memcpy(body, delivery->body.data, delivery->body.length);
+        body[delivery->body.length] = '\0';
+        delivery->body.data = body;
+        delivery->body_in_frame = false;
+    }
+    const amqp_basic_properties_t* from = delivery->properties;
+    if (!from) return;
+    amqp_basic_properties_t* to = ArenaAlloc(arena, sizeof(amqp_basic_properties_t));
+    *to = (amqp_basic_properties_t){
+        ._flags = from->_flags & (AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_CONTENT_ENCODING_FLAG | AMQP_BASIC_HEADERS_FLAG |
+                                  AMQP_BASIC_DELIVERY_MODE_FLAG | AMQP_BASIC_CORRELATION_ID_FLAG |
+                                  AMQP_BASIC_MESSAGE_ID_FLAG | AMQP_BASIC_TIMESTAMP_FLAG),
+        .content_type = copy_bytes(from->content_type, arena),
+        .content_encoding = copy_bytes(from->content_encoding, arena),
+        .delivery_mode = from->delivery_mode,
+        .correlation_id = copy_bytes(from->correlation_id, arena),
+        .message_id = copy_bytes(from->message_id, arena),
+        .timestamp = from->timestamp,
+    };
+    if (from->_flags & AMQP_BASIC_HEADERS_FLAG) {
+        to->headers.entries = ArenaAlloc(arena, sizeof(amqp_table_entry_t) * Max(from->headers.num_entries, 1));
+        for (int i = 0; i < from->headers.num_entries; i++) {
+            const amqp_table_entry_t* entry = &from->headers.entries[i];
+            if (entry->value.kind == AMQP_FIELD_KIND_TABLE || entry->value.kind == AMQP_FIELD_KIND_ARRAY) continue;
+            amqp_table_entry_t* copy = &to->headers.entries[to->headers.num_entries++];
+            *copy = (amqp_table_entry_t){ .key = copy_bytes(entry->key, arena), .value = entry->value };
+            if (entry->value.kind == AMQP_FIELD_KIND_UTF8 || entry->value.kind == AMQP_FIELD_KIND_BYTES) {
+                copy->value.value.bytes = copy_bytes(entry->value.value.bytes, arena);
+            }
+        }
+    }
+    delivery->properties = to;
+}
+
+/* The number of ready messages from a passive declare on the consuming channel, deliveries that arrive before the
+ * reply are queued by librabbitmq and read as usual. Returns -1 when the queue couldn't be inspected. */
+i64 queue_depth(amqp_connection_state_t conn, const char* queue_name) {
+    const amqp_queue_declare_ok_t* ok = amqp_queue_declare(conn, RABBIT_CHANNEL, amqp_cstring_bytes(queue_name), 1, 0, 0, 0, amqp_empty_table);
+    if (!ok || amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL) {
+        LogWarn("Couldn't read the depth of queue '%s'", queue_name);
+        return -1;
+    }
+    return ok->message_count;
+}
+
+/* Failed deliveries wait out RETRY_DELAY_MS in "<queue>.retry", whose TTL dead-letters them back onto the
+ * source queue, so the consumer never sleeps on a retry. Deliveries out of attempts end up in "<queue>.dead". */
+bool declare_retry_queues(amqp_connection_state_t conn, Dotenv* env, const char* queue_name) {
+    char retry_queue[256], dead_queue[256];
+    snprintf(retry_queue, sizeof(retry_queue), "%s.retry", queue_name);
+    snprintf(dead_queue, sizeof(dead_queue), "%s.dead", queue_name);
+
+    amqp_table_entry_t entries[3] = {
+        { .key = amqp_cstring_bytes("x-message-ttl"), .value = { .kind = AMQP_FIELD_KIND_I32, .value.i32 = env->retry_delay_ms } },
+        { .key = amqp_cstring_bytes("x-dead-letter-exchange"), .value = { .kind = AMQP_FIELD_KIND_UTF8, .value.bytes = amqp_empty_bytes } },
+        { .key = amqp_cstring_bytes("x-dead-letter-routing-key"), .value = { .kind = AMQP_FIELD_KIND_UTF8, .value.bytes = amqp_cstring_bytes(queue_name) } },
+    };
+    const amqp_table_t retry_arguments = { .num_entries = 3, .entries = entries };
+
+    amqp_queue_declare(conn, RABBIT_CHANNEL, amqp_cstring_bytes(retry_queue), 0, 1, 0, 0, retry_arguments);
+    if (amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL) {
+        LogError("Declaring retry queue '%s' failed, an existing queue with other arguments has to be deleted first", retry_queue);
+        return false;
+    }
+    amqp_queue_declare(conn, RABBIT_CHANNEL, amqp_cstring_bytes(dead_queue), 0, 1, 0, 0, amqp_empty_table);
+    if (amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL) {
+        LogError("Declaring dead-letter queue '%s' failed", dead_queue);
+        return false;
+    }
+    return true;
+}
+
+static const amqp_field_value_t* delivery_header(const Delivery* delivery, const char* name) {
+    const amqp_basic_properties_t* properties = delivery->properties;
+    if (!properties || !(properties->_flags & AMQP_BASIC_HEADERS_FLAG)) return nullptr;
+    for (int i = 0; i < properties->headers.num_entries; i++) {
+        if (header_is(&properties->headers.entries[i], name)) return &properties->headers.entries[i].value;
+    }
+    return nullptr;
+}
+
+i32 delivery_attempts(const Delivery* delivery) {
+    const amqp_field_value_t* value = delivery_header(delivery, ATTEMPTS_HEADER);
+    if (!value) return 0;
+    switch (value->kind) {
+        case AMQP_FIELD_KIND_I8: return value->value.i8;
+        case AMQP_FIELD_KIND_U8: return value->value.u8;
+        case AMQP_FIELD_KIND_I16: return value->value.i16;
+        case AMQP_FIELD_KIND_U16: return value->value.u16;
+        case AMQP_FIELD_KIND_I32: return value->value.i32;
+        case AMQP_FIELD_KIND_U32: return (i32)Min(value->value.u32, (u32)I32_MAX);
+        case AMQP_FIELD_KIND_I64: return (i32)Clamp(0, value->value.i64, I32_MAX);
+        default: return 0;
+    }
+}
+
+u64 delivery_requests_done(const Delivery* delivery) {
+    const amqp_field_value_t* value = delivery_header(delivery, REQUESTS_DONE_HEADER);
+    return value && value->kind == AMQP_FIELD_KIND_I64 ? (u64)value->value.i64 : 0;
+}
+
+static amqp_connection_state_t open_publisher(Dotenv* env) {
+    amqp_connection_state_t conn = connect_rabbitmq(env);
+    if (!conn) return nullptr;
+    amqp_channel_open(conn, RABBIT_CHANNEL);
+    if (amqp_get_rpc_reply(conn).reply_type == AMQP_RESPONSE_NORMAL) {
+        amqp_confirm_select(conn, RABBIT_CHANNEL);
+        if (amqp_get_rpc_reply(conn).reply_type == AMQP_RESPONSE_NORMAL) return conn;
+    }
+    LogError("Opening the RabbitMQ publisher channel failed");
+    amqp_destroy_connection(conn);
+    return nullptr;
+}
+
+Publisher publisher_new(Dotenv* env) {
+    return (Publisher){ .env = env };
+}
+
+/* Whatever was published on the lost connection can't be confirmed anymore, it is handed back as failed. */
+static void publisher_drop(Publisher* publisher) {
+    drop_rabbitmq(publisher->conn);
+    publisher->conn = nullptr;
+    publisher->returned = false;
+    for (i32 i = 0; i < publisher->pending_count; i++) {
+        if (publisher->pending[i].state == PUBLISH_PENDING) publisher->pending[i].sequence = 0;
+    }
+}
+
+void publisher_close(Publisher* publisher) {
+    close_rabbitmq(publisher->conn);
+    Free(publisher->pending);
+    *publisher = publisher_new(publisher->env);
+}
+
+void publisher_forget(Publisher* publisher) {
+    publisher->pending_count = 0;
+}
+
+int publisher_fd(const Publisher* publisher) {
+    return publisher->conn ? amqp_get_sockfd(publisher->conn) : -1;
+}
+
+i64 publisher_due_in(const Publisher* publisher) {
+    if (publisher->pending_count == 0) return -1;
+    const i64 elapsed = TimeNow() - publisher->pending[0].sent_ms;
+    return elapsed >= PUBLISH_CONFIRM_MS ? 0 : PUBLISH_CONFIRM_MS - elapsed;
+}
+
+static void publisher_settle(Publisher* publisher, u64 sequence, bool multiple, PublishState state) {
+    for (i32 i = 0; i < publisher->pending_count; i++) {
+        PublishConfirm* pending = &publisher->pending[i];
+        if (pending->state != PUBLISH_PENDING || pending->sequence == 0) continue;
+        if (pending->sequence == sequence || (multiple && pending->sequence < sequence)) pending->state = state;
+    }
+}
+
+/* A basic.return names no sequence, but it comes right before the basic.ack of the same publish. */
+static bool publisher_read_frame(Publisher* publisher, const struct timeval* timeout) {
+    amqp_frame_t frame;
+    amqp_maybe_release_buffers(publisher->conn);
+    const int status = amqp_simple_wait_frame_noblock(publisher->conn, &frame, timeout);
+    if (status == AMQP_STATUS_TIMEOUT) return false;
+    if (status != AMQP_STATUS_OK) {
+        LogError("Reading publisher confirms failed: %s", amqp_error_string2(status));
+        publisher_drop(publisher);
+        return true;
+    }
+    if (frame.frame_type != AMQP_FRAME_METHOD) return true;
+    switch (frame.payload.method.id) {
+        case AMQP_BASIC_ACK_METHOD: {
+            const amqp_basic_ack_t* ack = frame.payload.method.decoded;
+            if (publisher->returned) {
+                LogError("Republish %" PRIu64 " was returned, its queue doesn't exist", ack->delivery_tag);
+                publisher_settle(publisher, ack->delivery_tag, false, PUBLISH_FAILED);
+                publisher->returned = false;
+            }
+            publisher_settle(publisher, ack->delivery_tag, ack->multiple, PUBLISH_CONFIRMED);
+            return true;
+        }
+        case AMQP_BASIC_NACK_METHOD: {
+            const amqp_basic_nack_t* nack = frame.payload.method.decoded;
+            LogError("The broker refused republish %" PRIu64, nack->delivery_tag);
+            publisher_settle(publisher, nack->delivery_tag, nack->multiple, PUBLISH_FAILED);
+            return true;
+        }
+        case AMQP_BASIC_RETURN_METHOD: {
+            amqp_message_t message;
+            if (amqp_read_message(publisher->conn, frame.channel, &message, 0).reply_type != AMQP_RESPONSE_NORMAL) {
+                publisher_drop(publisher);
+                return true;
+            }
+            amqp_destroy_message(&message);
+            publisher->returned = true;
+            return true;
+        }
+        default:
+            LogError("Unexpected method 0x%08x on the publisher connection", frame.payload.method.id);
+            publisher_drop(publisher);
+            return true;
+    }
+}
+
+/* Settled publishes are handed back in publish order. One that isn't confirmed within PUBLISH_CONFIRM_MS gives up its
+ * connection, with everything else still pending on it. */
+bool publisher_next_confirm(Publisher* publisher, const struct timeval* timeout, PublishConfirm* confirm) {
+    while (publisher->pending_count > 0) {
+        PublishConfirm* oldest = &publisher->pending[0];
+        if (oldest->sequence == 0) oldest->state = PUBLISH_FAILED;
+        if (oldest->state != PUBLISH_PENDING) {
+            *confirm = *oldest;
+            publisher->pending_count--;
+            memmove(publisher->pending, publisher->pending + 1, sizeof(PublishConfirm) * publisher->pending_count);
+            return true;
+        }
+        if (publisher_due_in(publisher) == 0) {
+            LogError("No confirm for republish %" PRIu64 " within %dms", oldest->sequence, PUBLISH_CONFIRM_MS);
+            publisher_drop(publisher);
+            continue;
+        }
+        if (!publisher_read_frame(publisher, timeout)) return false;
+    }
+    return false;
+}
+
+static u64 publisher_send(Publisher* publisher, const char* target, const amqp_basic_properties_t* properties,
+                          amqp_bytes_t body) {
+    if (!publisher->conn) {
+        publisher->conn = open_publisher(publisher->env);
+        publisher->next_sequence = 1;
+        if (!publisher->conn) return 0;
+    }
+    const int status = amqp_basic_publish(publisher->conn, RABBIT_CHANNEL, amqp_empty_bytes, amqp_cstring_bytes(target), 1, 0,
+                                          properties, body);
+    if (status != AMQP_STATUS_OK) {
+        LogError("Republishing to '%s' failed: %s", target, amqp_error_string2(status));
+        publisher_drop(publisher);
+        return 0;
+    }
+    return publisher->next_sequence++;
+}
+
+/* Republishes a delivery that didn't make it to its sink with its attempt count bumped and requests_done recorded, so
+ * a retry skips the HTTP requests that already went out. Retryable failures go to the retry queue until
+ * RETRY_MAX_ATTEMPTS is reached, everything else straight to the dead-letter queue.
+ *
+ * Returns whether the copy went out, its confirm arrives later through publisher_next_confirm and only then may the
+ * original be acknowledged. When it didn't go out the caller has to requeue the original. A crash in between only
+ * duplicates the message. */
+bool reject_delivery(Publisher* publisher, const char* queue_name, const Delivery* delivery, bool retryable,
+                     u64 requests_done, Arena* arena) {
+    Dotenv* env = publisher->env;
+    const i32 attempts = delivery_attempts(delivery) + 1;
+    const bool retry = retryable && attempts < env->retry_max_attempts;
+    char target[256];
+    snprintf(target, sizeof(target), retry ? "%s.retry" : "%s.dead", queue_name);
+
+    amqp_basic_properties_t properties = {0};
+    const amqp_table_t* headers = nullptr;
+    if (delivery->properties) {
+        properties = *delivery->properties;
+        if (properties._flags & AMQP_BASIC_HEADERS_FLAG) headers = &delivery->properties->headers;
+    }
+    const int header_count = headers ? headers->num_entries : 0;
+    amqp_table_entry_t* entries = ArenaAlloc(arena, sizeof(amqp_table_entry_t) * (header_count + 2));
+    int entry_count = 0;
+    for (int i = 0; i < header_count; i++) {
+        const amqp_table_entry_t* entry = &headers->entries[i];
+        if (!header_is(entry, ATTEMPTS_HEADER) && !header_is(entry, REQUESTS_DONE_HEADER)) entries[entry_count++] = *entry;
+    }
+    entries[entry_count++] = (amqp_table_entry_t){
+        .key = amqp_cstring_bytes(ATTEMPTS_HEADER), .value = { .kind = AMQP_FIELD_KIND_I32, .value.i32 = attempts },
+    };
+    if (requests_done) {
+        entries[entry_count++] = (amqp_table_entry_t){
+            .key = amqp_cstring_bytes(REQUESTS_DONE_HEADER),
+            .value = { .kind = AMQP_FIELD_KIND_I64, .value.i64 = (i64)requests_done },
+        };
+    }
+    properties.headers = (amqp_table_t){ .num_entries = entry_count, .entries = entries };
+    properties._flags |= AMQP_BASIC_HEADERS_FLAG | AMQP_BASIC_DELIVERY_MODE_FLAG;
+    properties.delivery_mode = AMQP_DELIVERY_PERSISTENT;
+
+    /* An idle publisher may have been closed by the broker for missing heartbeats, so a reused one gets a second try. */
+    const amqp_bytes_t body = { .len = delivery->body.length, .bytes = delivery->body.data };
+    const bool reused = publisher->conn != nullptr;
+    u64 sequence = publisher_send(publisher, target, &properties, body);
+    if (!sequence && reused) sequence = publisher_send(publisher, target, &properties, body);
+    if (!sequence) return false;
+
+    if (publisher->pending_count == publisher->pending_capacity) {
+        publisher->pending_capacity = Max(publisher->pending_capacity * 2, 16);
+        publisher->pending = Realloc(publisher->pending, sizeof(PublishConfirm) * publisher->pending_capacity);
+    }
+    publisher->pending[publisher->pending_count++] = (PublishConfirm){
+        .sequence = sequence, .delivery_tag = delivery->delivery_tag, .sent_ms = TimeNow(),
+    };
+    if (retry) {
+        LogWarn("Delivery %" PRIu64 " failed, retry %d of %d in %dms", delivery->delivery_tag, attempts,
+                env->retry_max_attempts - 1, env->retry_delay_ms);
+    } else {
+        LogWarn("Delivery %" PRIu64 " moved to '%s' after %d attempt(s)", delivery->delivery_tag, target, attempts);
+    }
+    return true;
+}
+
+/* ====== [RETRY] ====== */
+
+AckWindow ack_window_new(amqp_connection_state_t conn, i32 batch_size) {
+    return (AckWindow){ .conn = conn, .batch_size = batch_size > 0 ? batch_size : 1 };
+}
+
+void ack_window_reset(AckWindow* window, amqp_connection_state_t conn) {
+    window->conn = conn;
+    window->pending = 0;
+    window->held = 0;
+}
+
+void ack_window_free(AckWindow* window) {
+    Free(window->tags);
+    window->tags = nullptr;
+    window->tag_capacity = 0;
+}
+
+/* Tags arrive in order except for held ones released late, so the insert rarely moves anything. */
+void ack_window_track(AckWindow* window, u64 delivery_tag) {
+    if (window->pending == window->tag_capacity) {
+        window->tag_capacity = Max(window->tag_capacity * 2, 64);
+        window->tags = Realloc(window->tags, sizeof(u64) * window->tag_capacity);
+    }
+    if (window->pending == 0) window->oldest_ms = TimeNow();
+    i32 i = window->pending++;
+    for (; i > 0 && window->tags[i - 1] > delivery_tag; i--) window->tags[i] = window->tags[i - 1];
+    window->tags[i] = delivery_tag;
+    if (window->pending >= window->batch_size) {
+        ack_window_flush(window);
+    }
+}
+
+bool ack_window_flush(AckWindow* window) {
+    if (window->pending == 0 || window->held > 0) return true;
+    const u64 last_tag = window->tags[window->pending - 1];
+    const int status = amqp_basic_ack(window->conn, RABBIT_CHANNEL, last_tag, 1);
+    if (status != AMQP_STATUS_OK) {
+        LogError("Ack of %d deliveries up to %" PRIu64 " failed: %s", window->pending, last_tag, amqp_error_string2(status));
+        return false;
+    }
+    window->pending = 0;
+    return true;
+}
+
+/* Hands every pending delivery back to the broker with one basic.nack multiple=true, requeue=true, or one by one while
+ * held deliveries are among them. Both this and ack_window_flush keep the deliveries pending when the broker couldn't
+ * be told. */
+bool ack_window_requeue(AckWindow* window) {
+    if (window->pending == 0) return true;
+    if (window->held > 0) {
+        i32 requeued = 0;
+        while (requeued < window->pending && requeue_delivery(window->conn, window->tags[requeued])) requeued++;
+        window->pending -= requeued;
+        memmove(window->tags, window->tags + requeued, sizeof(u64) * window->pending);
+        return window->pending == 0;
+    }
+    const u64 last_tag = window->tags[window->pending - 1];
+    const int status = amqp_basic_nack(window->conn, RABBIT_CHANNEL, last_tag, 1, 1);
+    if (status != AMQP_STATUS_OK) {
+        LogError("Requeue of deliveries up to %" PRIu64 " failed: %s", last_tag, amqp_error_string2(status));
+        return false;
+    }
+    window->pending = 0;
+    return true;
+}
+
+static bool contains_tag(const u64* delivery_tags, i32 count, u64 delivery_tag) {
+    for (i32 i = 0; i < count; i++) {
+        if (delivery_tags[i] == delivery_tag) return true;
+    }
+    return false;
+}
+
+/* Requeues single deliveries of the window with basic.nack and drops them from it, so the next ack_window_flush
+ * doesn't name a requeued tag. */
+bool ack_window_requeue_some(AckWindow* window, const u64* delivery_tags, i32 count) {
+    if (window->pending == 0 || count == 0) return true;
+    i32 kept = 0;
+    bool ok = true;
+    for (i32 i = 0; i < window->pending; i++) {
+        const u64 tag = window->tags[i];
+        if (ok && contains_tag(delivery_tags, count, tag)) {
+            ok = requeue_delivery(window->conn, tag);
+            if (ok) continue;
+        }
+        window->tags[kept++] = tag;
+    }
+    window->pending = kept;
+    return ok;
+}
+
+void ack_window_hold(AckWindow* window) {
+    window->held++;
+}
+
+bool ack_window_release(AckWindow* window, u64 delivery_tag, bool confirmed) {
+    if (window->held > 0) window->held--;
+    if (!confirmed) return requeue_delivery(window->conn, delivery_tag);
+    ack_window_track(window, delivery_tag);
+    return true;
+}
+
+/* Milliseconds left until the oldest pending delivery has to be acknowledged, -1 when nothing is pending or held
+ * deliveries keep the window from being acknowledged, whoever holds them polls for their confirms instead. */
+i64 ack_window_due_in(const AckWindow* window, i32 interval_ms) {
+    if (window->pending == 0 || window->held > 0) return -1;
+    const i64 elapsed = TimeNow() - window->oldest_ms;
+    return elapsed >= interval_ms ? 0 : interval_ms - elapsed;
+}
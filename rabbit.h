@@ -2,6 +2,123 @@
 #include <rabbitmq-c/amqp.h>
 #include "config.h"
 
+#define RABBIT_CHANNEL 1
+
+/* AckWindow batches manual acknowledgements, deliveries are tracked once their sink writes are done
+ * and acknowledged together with a single basic.ack multiple=true. Held deliveries are republished ones waiting for
+ * their confirm, nothing is acknowledged while there are any since multiple=true would take them along. */
+typedef struct {
+    amqp_connection_state_t conn;
+    /* The tracked tags in ascending order, so single ones can be requeued without naming them in the next ack. */
+    u64* tags;
+    i32 tag_capacity;
+    i32 pending;
+    i32 held;
+    i32 batch_size;
+    i64 oldest_ms;
+} AckWindow;
+
+typedef enum {
+    PUBLISH_PENDING = 0,
+    PUBLISH_CONFIRMED,
+    PUBLISH_FAILED,
+} PublishState;
+
+typedef struct {
+    u64 sequence;
+    u64 delivery_tag;
+    PublishState state;
+    i64 sent_ms;
+} PublishConfirm;
+
+/* A Publisher republishes failed deliveries on a connection of its own in confirm mode, opened on first use: reading
+ * confirms on the consuming connection would read past deliveries librabbitmq can't put back. Nothing waits for a
+ * confirm, the caller collects them with publisher_next_confirm and settles the original delivery then. */
+typedef struct {
+    Dotenv* env;
+    amqp_connection_state_t conn;
+    u64 next_sequence;
+    /* In publish order, a sequence of 0 belongs to a publish whose connection was lost. */
+    PublishConfirm* pending;
+    i32 pending_count;
+    i32 pending_capacity;
+    /* A mandatory publish that found no queue comes back as basic.return right before its basic.ack. */
+    bool returned;
+} Publisher;
+
+/* A Delivery is one basic.deliver with its content. Properties and single-frame bodies point into librabbitmq's
+ * frame buffers and stay valid until amqp_maybe_release_buffers, larger bodies are assembled in the caller's Arena. */
+typedef struct {
+    u64 delivery_tag;
+    bool redelivered;
+    bool body_in_frame;
+    amqp_basic_properties_t* properties;
+    String body;
+} Delivery;
+
 amqp_connection_state_t connect_rabbitmq(Dotenv *env);
 
 amqp_connection_state_t create_rabbitmq_consumer(Dotenv *env, const char *queue_name);
+
+void close_rabbitmq(amqp_connection_state_t conn);
+
+void drop_rabbitmq(amqp_connection_state_t conn);
+
+bool requeue_delivery(amqp_connection_state_t conn, u64 delivery_tag);
+
+int read_delivery(amqp_connection_state_t conn, Arena* arena, Delivery* delivery, const struct timeval* timeout);
+
+void detach_delivery(Delivery* delivery, Arena* arena);
+
+String delivery_content_type(const Delivery* delivery);
+
+i64 queue_depth(amqp_connection_state_t conn, const char* queue_name);
+
+bool declare_retry_queues(amqp_connection_state_t conn, Dotenv* env, const char* queue_name);
+
+i32 delivery_attempts(const Delivery* delivery);
+
+/* The requests_done a retried delivery was republished with, 0 for a first attempt. */
+u64 delivery_requests_done(const Delivery* delivery);
+
+Publisher publisher_new(Dotenv* env);
+
+/* Publishes still waiting for their confirm are given up, the broker redelivers their originals. */
+void publisher_close(Publisher* publisher);
+
+/* For a consuming connection that is gone: its delivery tags mean nothing on the next one. */
+void publisher_forget(Publisher* publisher);
+
+/* The publisher's socket, -1 while it has no connection. */
+int publisher_fd(const Publisher* publisher);
+
+/* Milliseconds until the oldest unconfirmed publish is given up, -1 when nothing waits for a confirm. */
+i64 publisher_due_in(const Publisher* publisher);
+
+/* Reads whatever confirms arrived, waiting at most timeout, and hands back one settled publish at a time. */
+bool publisher_next_confirm(Publisher* publisher, const struct timeval* timeout, PublishConfirm* confirm);
+
+bool reject_delivery(Publisher* publisher, const char* queue_name, const Delivery* delivery, bool retryable,
+                     u64 requests_done, Arena* arena);
+
+AckWindow ack_window_new(amqp_connection_state_t conn, i32 batch_size);
+
+/* Forgets every pending delivery, for a new consuming connection. */
+void ack_window_reset(AckWindow* window, amqp_connection_state_t conn);
+
+void ack_window_free(AckWindow* window);
+
+void ack_window_track(AckWindow* window, u64 delivery_tag);
+
+bool ack_window_flush(AckWindow* window);
+
+bool ack_window_requeue(AckWindow* window);
+
+bool ack_window_requeue_some(AckWindow* window, const u64* delivery_tags, i32 count);
+
+i64 ack_window_due_in(const AckWindow* window, i32 interval_ms);
+
+void ack_window_hold(AckWindow* window);
+
+/* Settles a held delivery once its republish is confirmed or failed, a failed one is requeued. */
+bool ack_window_release(AckWindow* window, u64 delivery_tag, bool confirmed);
@@ -0,0 +1,46 @@
+#include "reconnect.h"
+#include "worker.h"
+
+#define BACKOFF_WAIT_STEP_MS 100
+
+static thread_local u64 jitter_state;
+
+static u64 jitter_next(void) {
+    if (jitter_state == 0) {
+        jitter_state = ((u64)TimeNow() << 16) ^ (u64)(uintptr_t)&jitter_state;
+        if (jitter_state == 0) jitter_state = 0x9E3779B97F4A7C15ull;
+    }
+    jitter_state ^= jitter_state << 13;
+    jitter_state ^= jitter_state >> 7;
+    jitter_state ^= jitter_state << 17;
+    return jitter_state;
+}
+
+Backoff backoff_new(i64 base_ms, i64 max_ms) {
+    return (Backoff){ .base_ms = Max(base_ms, 1), .max_ms = Max(max_ms, base_ms) };
+}
+
+i64 backoff_next_ms(Backoff* backoff) {
+    i64 ceiling = backoff->base_ms;
+    for (i32 i = 0; i < backoff->attempt && ceiling < backoff->max_ms; i++) {
+        ceiling *= 2;
+    }
+    ceiling = Min(ceiling, backoff->max_ms);
+    backoff->attempt++;
+    return (i64)(jitter_next() % (u64)(ceiling + 1));
+}
+
+void backoff_reset(Backoff* backoff) {
+    backoff->attempt = 0;
+}
+
+/* Sleeps for the next delay in small steps, returns false as soon as a stop was requested. */
+bool backoff_wait(Backoff* backoff, const char* what) {
+    const i64 delay = backoff_next_ms(backoff);
+    LogWarn("%s: Retrying in %" PRIi64 " ms (attempt %d)", what, delay, backoff->attempt);
+    for (i64 waited = 0; waited < delay; waited += BACKOFF_WAIT_STEP_MS) {
+        if (workers_should_stop()) return false;
+        WaitTime(Min(BACKOFF_WAIT_STEP_MS, delay - waited));
+    }
+    return !workers_should_stop();
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include "include/base.h"
+
+/* Backoff spaces out reconnect attempts with "full jitter": the n-th delay is drawn uniformly from
+ * [0, min(max_ms, base_ms * 2^n)], so workers that lost a backend together don't retry in lockstep. */
+typedef struct {
+    i64 base_ms;
+    i64 max_ms;
+    i32 attempt;
+} Backoff;
+
+Backoff backoff_new(i64 base_ms, i64 max_ms);
+
+i64 backoff_next_ms(Backoff* backoff);
+
+void backoff_reset(Backoff* backoff);
+
+bool backoff_wait(Backoff* backoff, const char* what);
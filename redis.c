@@ -1,25 +1,34 @@
 #include "redis.h"
 #include "utils.h"
-#include <jansson.h>
 #include <stdlib.h>
 
-redisContext* connectRedis(String redis_url, Arena *arena) {
-    const Conn conn = parseRedisUrl(arena, redis_url);
+static int parseRedisPort(const Conn* conn) {
+    if (!conn->port.data) {
+        printf("Error: Port missing.\n");
+        return -1;
+    }
     char *endptr;
     errno = 0;
-    const long val = strtol(conn.port.data, &endptr, 10);
+    const long val = strtol(conn->port.data, &endptr, 10);
     if (*endptr != '\0' || errno != 0) {
         printf("Error: Couldn't convert port string to integer.\n");
-        return nullptr;
+        return -1;
     }
     if (val < 0 || val > 65535) {
         printf("Error: Port number out of range.\n");
-        return nullptr;
+        return -1;
     }
-    const int port = (int)val;
-
-    if (!conn.ip.data) {
+    if (!conn->ip.data) {
         printf("Error: IP address missing.\n");
+        return -1;
+    }
+    return (int)val;
+}
+
+redisContext* connectRedis(String redis_url, Arena *arena) {
+    const Conn conn = parseRedisUrl(arena, redis_url);
+    const int port = parseRedisPort(&conn);
+    if (port < 0) {
         return nullptr;
     }
 
@@ -58,61 +67,281 @@ redisContext* connectRedis(String redis_url, Arena *arena) {
     return c;
 }
 
+redisAsyncContext* connectRedisAsync(String redis_url, Arena *arena) {
+    const Conn conn = parseRedisUrl(arena, redis_url);
+    const int port = parseRedisPort(&conn);
+    if (port < 0) {
+        return nullptr;
+    }
 
-void ensureChatExists(redisContext* redis_conn, Arena* arena, String chat_id, String remote_jid, String chat_metadata, String message_data) {
-    String norm_chat_id = normalizeChatId(arena, chat_id);
-    String chat_key = F(arena, "chat:%s", norm_chat_id.data);
-    redisReply* exists_reply = redisCommand(redis_conn, "EXISTS %s", chat_key.data);
-    if (!exists_reply) {
-        LogError("Redis EXISTS command failed.");
+    redisAsyncContext* ac = redisAsyncConnect(conn.ip.data, port);
+    if (ac == nullptr || ac->err) {
+        if (ac) {
+            printf("Error: Couldn't connect to Redis: %s\n", ac->errstr);
+            redisAsyncFree(ac);
+        } else {
+            printf("Error: Couldn't allocate redis async context.\n");
+        }
+        return nullptr;
+    }
+    return ac;
+}
+
+static void onAsyncAuthReply(redisAsyncContext* ac, void* r, void* privdata) {
+    (void)ac;
+    (void)privdata;
+    redisReply* reply = r;
+    if (!reply) {
+        printf("AUTH command failed.\n");
+    } else if (reply->type == REDIS_REPLY_ERROR) {
+        printf("AUTH error: %s\n", reply->str);
+    }
+}
+
+/* AUTH is queued like any other command, so the context must already be attached to its event loop. */
+void authRedisAsync(redisAsyncContext* ac, String redis_url, Arena *arena) {
+    const Conn conn = parseRedisUrl(arena, redis_url);
+    if (!conn.password.data || conn.password.data[0] == '\0') {
         return;
     }
-    int exists = 0;
-    if (exists_reply->type == REDIS_REPLY_INTEGER) {
-        exists = exists_reply->integer;
+    if (conn.user.data && conn.user.data[0] != '\0') {
+        redisAsyncCommand(ac, onAsyncAuthReply, nullptr, "AUTH %s %s", conn.user.data, conn.password.data);
+    } else {
+        redisAsyncCommand(ac, onAsyncAuthReply, nullptr, "AUTH %s", conn.password.data);
     }
-    freeReplyObject(exists_reply);
-    if (!exists) {
-        String chat_data;
-        if (!StrIsNull(chat_metadata)) {
-            chat_data = chat_metadata;
-        } else {
-            char* at = strchr(remote_jid.data, '@');
-            String number = at ? StrSlice(arena, remote_jid, 0, at - remote_jid.data) : remote_jid;
-            String instance_id = (String){0};
-            if (!StrIsNull(message_data)) {
-                json_error_t error;
-                json_t* root = json_loads(message_data.data, 0, &error);
-                if (root) {
-                    json_t* apikey = json_object_get(root, "apikey");
-                    if (apikey && json_is_string(apikey)) {
-                        instance_id = StrNew(arena, (char*)json_string_value(apikey));
-                    }
-                    json_decref(root);
-                }
-            }
-            chat_data = F(arena,
-                "{\"id\":\"%s\",\"situation\":\"enqueued\",\"is_active\":true,\"agent_id\":null,\"tabulation\":null,\"instance_id\":\"%s\",\"number\":\"%s\"}",
-                norm_chat_id.data, instance_id.data ? instance_id.data : "", number.data);
+}
+
+
+/* The entry a new chat starts with when the producer didn't send its own metadata. */
+static String buildChatData(Arena* arena, String norm_chat_id, String remote_jid, String instance_id) {
+    char* at = strchr(remote_jid.data, '@');
+    String number = at ? StrSlice(arena, remote_jid, 0, at - remote_jid.data) : remote_jid;
+    return F(arena,
+        "{\"id\":\"%s\",\"situation\":\"enqueued\",\"is_active\":true,\"agent_id\":null,\"tabulation\":null,\"instance_id\":\"%s\",\"number\":\"%s\"}",
+        norm_chat_id.data, instance_id.data ? instance_id.data : "", number.data);
+}
+
+static bool readPipelinedReply(redisContext* redis_conn, redisReply** reply) {
+    if (redisGetReply(redis_conn, (void**)reply) != REDIS_OK || !*reply) {
+        LogError("Redis pipeline failed: %s", redis_conn->errstr);
+        return false;
+    }
+    return true;
+}
+
+/* Reads the replies of count appended commands. False when the connection failed, *refused is set when Redis
+ * answered any of them with an error. */
+static bool readPipelinedReplies(redisContext* redis_conn, i32 count, bool* refused) {
+    for (i32 i = 0; i < count; i++) {
+        redisReply* reply;
+        if (!readPipelinedReply(redis_conn, &reply)) return false;
+        if (reply->type == REDIS_REPLY_ERROR) {
+            LogError("Redis command failed: %s", reply->str);
+            *refused = true;
         }
-        redisReply* rpush_reply = redisCommand(redis_conn, "RPUSH %s %s", chat_key.data, chat_data.data);
-        if (rpush_reply) freeReplyObject(rpush_reply);
-        LogInfo("Created new chat entry in Redis (as list): %s", chat_key.data);
-        redisReply* sadd_reply = redisCommand(redis_conn, "SADD chats %s", norm_chat_id.data);
-        if (sadd_reply) freeReplyObject(sadd_reply);
-        LogInfo("Added chat_id %s to 'chats' set", norm_chat_id.data);
-    } else {
+        freeReplyObject(reply);
+    }
+    return true;
+}
+
+/* The single writes and the batch flush append the same commands, the caller decides when to read the replies. */
+static void appendChatExists(redisContext* redis_conn, String chat_key) {
+    const char* argv[] = { "EXISTS", chat_key.data };
+    const size_t argvlen[] = { 6, chat_key.length };
+    redisAppendCommandArgv(redis_conn, 2, argv, argvlen);
+}
+
+/* Returns the number of commands appended. */
+static i32 appendChatEntry(redisContext* redis_conn, String chat_key, String norm_chat_id, String chat_data) {
+    const char* rpush_argv[] = { "RPUSH", chat_key.data, chat_data.data };
+    const size_t rpush_argvlen[] = { 5, chat_key.length, chat_data.length };
+    redisAppendCommandArgv(redis_conn, 3, rpush_argv, rpush_argvlen);
+    const char* sadd_argv[] = { "SADD", "chats", norm_chat_id.data };
+    const size_t sadd_argvlen[] = { 4, 5, norm_chat_id.length };
+    redisAppendCommandArgv(redis_conn, 3, sadd_argv, sadd_argvlen);
+    LogInfo("Created new chat entry in Redis (as list): %s", chat_key.data);
+    return 2;
+}
+
+/* One multi-value RPUSH for count messages. */
+static void appendMessages(redisContext* redis_conn, Arena* arena, String norm_chat_id, const IncomingMessage* first, i32 count) {
+    const String messages_key = F(arena, "chat:%s:messages", norm_chat_id.data);
+    const int argc = 2 + count;
+    const char** argv = ArenaAlloc(arena, sizeof(char*) * argc);
+    size_t* argvlen = ArenaAlloc(arena, sizeof(size_t) * argc);
+    argv[0] = "RPUSH";
+    argvlen[0] = 5;
+    argv[1] = messages_key.data;
+    argvlen[1] = messages_key.length;
+    i32 arg = 2;
+    for (const IncomingMessage* message = first; message && arg < argc; message = message->next, arg++) {
+        argv[arg] = message->json.data;
+        argvlen[arg] = message->json.length;
+    }
+    redisAppendCommandArgv(redis_conn, argc, argv, argvlen);
+}
+
+/* instance_id is the webhook's apikey, which the caller already has from parsing the webhook. */
+void ensureChatExists(redisContext* redis_conn, Arena* arena, String chat_id, String remote_jid, String chat_metadata, String instance_id) {
+    String norm_chat_id = normalizeChatId(arena, chat_id);
+    String chat_key = F(arena, "chat:%s", norm_chat_id.data);
+    appendChatExists(redis_conn, chat_key);
+    redisReply* exists_reply;
+    if (!readPipelinedReply(redis_conn, &exists_reply)) return;
+    const bool exists = exists_reply->type == REDIS_REPLY_INTEGER && exists_reply->integer != 0;
+    freeReplyObject(exists_reply);
+    if (exists) {
         LogInfo("Chat entry already exists in Redis: %s", chat_key.data);
+        return;
+    }
+    String chat_data;
+    if (!StrIsNull(chat_metadata)) {
+        chat_data = chat_metadata;
+    } else {
+        chat_data = buildChatData(arena, norm_chat_id, remote_jid, instance_id);
     }
+    bool refused = false;
+    readPipelinedReplies(redis_conn, appendChatEntry(redis_conn, chat_key, norm_chat_id, chat_data), &refused);
+    if (!refused) LogInfo("Added chat_id %s to 'chats' set", norm_chat_id.data);
 }
 
-void insertMessageToChat(redisContext* redis_conn, Arena* arena, String chat_id, String message_json, String remote_jid, String chat_metadata, String message_data) {
+void insertMessageToChat(redisContext* redis_conn, Arena* arena, String chat_id, String message_json, String remote_jid, String chat_metadata, String instance_id) {
     String norm_chat_id = normalizeChatId(arena, chat_id);
     printf("Inserting message into chat:%s for remote_jid:%s\n", norm_chat_id.data, remote_jid.data);
-    ensureChatExists(redis_conn, arena, norm_chat_id, remote_jid, chat_metadata, message_data);
-    String key = F(arena, "chat:%s:messages", norm_chat_id.data);
-    printf("Pushing message to Redis list: %s\n", key.data);
-    redisReply* rpush_reply = redisCommand(redis_conn, "RPUSH %s %s", key.data, message_json.data);
-    if (rpush_reply) freeReplyObject(rpush_reply);
-    printf("Successfully inserted message into Redis for chat:%s\n", norm_chat_id.data);
+    ensureChatExists(redis_conn, arena, norm_chat_id, remote_jid, chat_metadata, instance_id);
+    printf("Pushing message to Redis list: chat:%s:messages\n", norm_chat_id.data);
+    const IncomingMessage message = { .json = message_json };
+    appendMessages(redis_conn, arena, norm_chat_id, &message, 1);
+    bool refused = false;
+    if (readPipelinedReplies(redis_conn, 1, &refused) && !refused) {
+        printf("Successfully inserted message into Redis for chat:%s\n", norm_chat_id.data);
+    }
+}
+
+/* ====== [INCOMING BATCH] ====== */
+
+RedisBatch* newRedisBatch(i32 capacity) {
+    RedisBatch* batch = Malloc(sizeof(RedisBatch));
+    *batch = (RedisBatch){0};
+    batch->arena = ArenaCreate(1024 * 1024);
+    batch->capacity = capacity > 0 ? capacity : 1;
+    batch->table_size = 1;
+    while (batch->table_size < batch->capacity * 2) batch->table_size <<= 1;
+    batch->table = Malloc(sizeof(ChatBatch*) * batch->table_size);
+    batch->chats = Malloc(sizeof(ChatBatch*) * batch->capacity);
+    resetRedisBatch(batch);
+    return batch;
+}
+
+void resetRedisBatch(RedisBatch* batch) {
+    ArenaReset(batch->arena);
+    memset(batch->table, 0, sizeof(ChatBatch*) * batch->table_size);
+    batch->chat_count = 0;
+    batch->message_count = 0;
+}
+
+void freeRedisBatch(RedisBatch* batch) {
+    if (!batch) return;
+    ArenaFree(batch->arena);
+    Free(batch->table);
+    Free(batch->chats);
+    Free(batch);
+}
+
+static u32 hashChatId(String chat_id) {
+    u32 hash = 2166136261u;
+    for (size_t i = 0; i < chat_id.length; i++) {
+        hash = (hash ^ (u8)chat_id.data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Every String handed in must live in batch->arena, they are referenced until the next flush. */
+void addMessageToBatch(RedisBatch* batch, String chat_id, String remote_jid, String instance_id, String message_json,
+                       u64 delivery_tag) {
+    const String norm_chat_id = normalizeChatId(batch->arena, chat_id);
+    const u32 mask = (u32)batch->table_size - 1;
+    u32 index = hashChatId(norm_chat_id) & mask;
+    ChatBatch* chat = batch->table[index];
+    while (chat && !StrEq(chat->chat_id, norm_chat_id)) {
+        index = (index + 1) & mask;
+        chat = batch->table[index];
+    }
+    if (!chat) {
+        chat = ArenaAlloc(batch->arena, sizeof(ChatBatch));
+        chat->chat_id = norm_chat_id;
+        chat->remote_jid = remote_jid;
+        chat->instance_id = instance_id;
+        batch->table[index] = chat;
+        batch->chats[batch->chat_count++] = chat;
+    }
+    IncomingMessage* message = ArenaAlloc(batch->arena, sizeof(IncomingMessage));
+    message->json = message_json;
+    message->delivery_tag = delivery_tag;
+    if (chat->last) chat->last->next = message;
+    else chat->first = message;
+    chat->last = message;
+    chat->count++;
+    batch->message_count++;
+}
+
+/* Same writes as insertMessageToChat, but pipelined: one round trip for every chat's EXISTS, then one for the chat
+ * entries that are missing plus a single multi-value RPUSH per chat. Replies come back in the order the commands were
+ * appended, so each one is matched to its chat and only chats Redis refused a command of are marked failed. */
+bool flushRedisBatch(redisContext* redis_conn, RedisBatch* batch) {
+    if (batch->message_count == 0) return true;
+    Arena* arena = batch->arena;
+
+    String* chat_keys = ArenaAlloc(arena, sizeof(String) * batch->chat_count);
+    for (i32 i = 0; i < batch->chat_count; i++) {
+        chat_keys[i] = F(arena, "chat:%s", batch->chats[i]->chat_id.data);
+        appendChatExists(redis_conn, chat_keys[i]);
+    }
+    bool* missing = ArenaAlloc(arena, sizeof(bool) * batch->chat_count);
+    for (i32 i = 0; i < batch->chat_count; i++) {
+        redisReply* reply;
+        if (!readPipelinedReply(redis_conn, &reply)) return false;
+        if (reply->type == REDIS_REPLY_ERROR) {
+            LogError("Redis EXISTS for %s failed: %s", chat_keys[i].data, reply->str);
+            batch->chats[i]->failed = true;
+        }
+        missing[i] = reply->type == REDIS_REPLY_INTEGER && reply->integer == 0;
+        freeReplyObject(reply);
+    }
+
+    i32* replies = ArenaAlloc(arena, sizeof(i32) * batch->chat_count);
+    for (i32 i = 0; i < batch->chat_count; i++) {
+        ChatBatch* chat = batch->chats[i];
+        replies[i] = 0;
+        if (chat->failed) continue;
+        if (missing[i]) {
+            const String chat_data = buildChatData(arena, chat->chat_id, chat->remote_jid, chat->instance_id);
+            replies[i] += appendChatEntry(redis_conn, chat_keys[i], chat->chat_id, chat_data);
+        }
+        appendMessages(redis_conn, arena, chat->chat_id, chat->first, chat->count);
+        replies[i]++;
+    }
+
+    i32 refused_messages = 0;
+    for (i32 i = 0; i < batch->chat_count; i++) {
+        ChatBatch* chat = batch->chats[i];
+        if (!readPipelinedReplies(redis_conn, replies[i], &chat->failed)) return false;
+        if (chat->failed) refused_messages += chat->count;
+    }
+    if (refused_messages > 0) {
+        LogWarn("Redis refused %d of %d incoming messages, their deliveries go back to the queue", refused_messages,
+                batch->message_count);
+    }
+    LogInfo("Flushed %d incoming messages for %d chats to Redis", batch->message_count - refused_messages, batch->chat_count);
+    return true;
+}
+
+void refusedRedisMessages(const RedisBatch* batch, u64* delivery_tags, i32* count) {
+    *count = 0;
+    for (i32 i = 0; i < batch->chat_count; i++) {
+        if (!batch->chats[i]->failed) continue;
+        for (const IncomingMessage* message = batch->chats[i]->first; message; message = message->next) {
+            delivery_tags[(*count)++] = message->delivery_tag;
+        }
+    }
 }
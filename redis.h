@@ -1,10 +1,62 @@
 #pragma once
 #include <hiredis/hiredis.h>
+#include <hiredis/async.h>
 #include "include/base.h"
 
 redisContext* connectRedis(String redis_url, Arena *arena);
 
-void ensureChatExists(redisContext* redis_conn, char* chat_id, char* remote_jid, char* chat_metadata, char* message_data);
+redisAsyncContext* connectRedisAsync(String redis_url, Arena *arena);
+
+void authRedisAsync(redisAsyncContext* ac, String redis_url, Arena *arena);
+
+void ensureChatExists(redisContext* redis_conn, Arena* arena, String chat_id, String remote_jid, String chat_metadata, String instance_id);
+
+void insertMessageToChat(redisContext* redis_conn, Arena* arena, String chat_id, String message_json, String remote_jid, String chat_metadata, String instance_id);
+
+/* The delivery a message came from is kept, so it can be requeued if Redis refuses its chat's writes. */
+typedef struct IncomingMessage {
+    String json;
+    u64 delivery_tag;
+    struct IncomingMessage* next;
+} IncomingMessage;
+
+typedef struct {
+    String chat_id;
+    String remote_jid;
+    String instance_id;
+    IncomingMessage* first;
+    IncomingMessage* last;
+    i32 count;
+    bool failed;
+} ChatBatch;
+
+/* A RedisBatch groups incoming messages per chat, so flushing it costs two pipelined round trips no matter
+ * how many messages it holds. Everything added to it lives in its own Arena until resetRedisBatch. */
+typedef struct {
+    Arena* arena;
+    i32 capacity;
+    i32 message_count;
+    i32 chat_count;
+    i32 table_size;
+    ChatBatch** table;
+    ChatBatch** chats;
+} RedisBatch;
+
+RedisBatch* newRedisBatch(i32 capacity);
+
+void resetRedisBatch(RedisBatch* batch);
+
+void freeRedisBatch(RedisBatch* batch);
+
+void addMessageToBatch(RedisBatch* batch, String chat_id, String remote_jid, String instance_id, String message_json,
+                       u64 delivery_tag);
+
+/* False when the connection failed and nothing is known about what was written. Otherwise every chat is written
+ * except the ones Redis refused a command of, those are marked failed. */
+bool flushRedisBatch(redisContext* redis_conn, RedisBatch* batch);
+
+/* The delivery tags of every message in a failed chat, delivery_tags needs room for the batch's message_count. */
+void refusedRedisMessages(const RedisBatch* batch, u64* delivery_tags, i32* count);
 
 typedef struct {
     String ip;
@@ -0,0 +1,220 @@
+#include "replay.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "database.h"
+#include "process.h"
+#include "reconnect.h"
+#include "worker.h"
+
+#define REPLAY_ARENA_SIZE (1024 * 1024)
+/* Latencies are bucketed by power of two with 8 linear steps in between, so any percentile is off by at most 12.5%. */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_BUCKETS (64 << LATENCY_SUB_BITS)
+/* Envelopes are reported on their own, after the single operation actions. */
+#define ENVELOPE_STATS (OUTGOING_SEND_REQUEST + 1)
+#define ACTION_COUNT (ENVELOPE_STATS + 1)
+
+static const char* action_names[ACTION_COUNT] = { "unknown", "upsertChat", "upsertCustomer", "sendMessage", "sendRequest", "envelope" };
+
+typedef struct {
+    u64 count;
+    u64 failed;
+    u64 total_us;
+    u64 max_us;
+    u64 buckets[LATENCY_BUCKETS];
+} LatencyStats;
+
+typedef struct {
+    Dotenv* env;
+    String lines;
+    LatencyStats stats[ACTION_COUNT];
+} ReplayWorker;
+
+static u64 monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + (u64)ts.tv_nsec / 1000;
+}
+
+/* ====== [LATENCY] ====== */
+
+static i32 latency_bucket(u64 us) {
+    if (us < (1 << LATENCY_SUB_BITS)) return (i32)us;
+    const i32 msb = 63 - __builtin_clzll(us);
+    const i32 shift = msb - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) | (i32)((us >> shift) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+/* The upper edge of a bucket, which is what a percentile reports so it never understates. */
+static u64 latency_bucket_limit(i32 bucket) {
+    if (bucket < (1 << LATENCY_SUB_BITS)) return (u64)bucket;
+    const i32 shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    const u64 base = (u64)((bucket & ((1 << LATENCY_SUB_BITS) - 1)) | (1 << LATENCY_SUB_BITS));
+    return ((base + 1) << shift) - 1;
+}
+
+static void latency_record(LatencyStats* stats, u64 us, bool ok) {
+    stats->count++;
+    if (!ok) stats->failed++;
+    stats->total_us += us;
+    if (us > stats->max_us) stats->max_us = us;
+    stats->buckets[latency_bucket(us)]++;
+}
+
+static void latency_merge(LatencyStats* into, const LatencyStats* from) {
+    into->count += from->count;
+    into->failed += from->failed;
+    into->total_us += from->total_us;
+    if (from->max_us > into->max_us) into->max_us = from->max_us;
+    for (i32 i = 0; i < LATENCY_BUCKETS; i++) into->buckets[i] += from->buckets[i];
+}
+
+static u64 latency_percentile(const LatencyStats* stats, f64 percentile) {
+    const u64 rank = (u64)(stats->count * percentile);
+    u64 seen = 0;
+    for (i32 i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (seen > rank) return Min(latency_bucket_limit(i), stats->max_us);
+    }
+    return stats->max_us;
+}
+
+/* ====== [LATENCY] ====== */
+
+
+static String next_line(String* rest) {
+    const char* end = memchr(rest->data, '\n', rest->length);
+    const size_t length = end ? (size_t)(end - rest->data) : rest->length;
+    String line = { .length = length, .data = rest->data };
+    rest->data += end ? length + 1 : length;
+    rest->length -= end ? length + 1 : length;
+    while (line.length > 0 && (line.data[line.length - 1] == '\r' || line.data[line.length - 1] == ' ')) line.length--;
+    return line;
+}
+
+/* A line whose sink connection dropped is retried on a fresh connection, a backfill must not skip messages. */
+static void* replay_worker_run(void* arg) {
+    ReplayWorker* worker = arg;
+    Dotenv* env = worker->env;
+    Arena* arena = ArenaCreate(REPLAY_ARENA_SIZE);
+    Backoff backoff = backoff_new(env->reconnect_base_ms, env->reconnect_max_ms);
+    PGconn* db = nullptr;
+    String rest = worker->lines;
+
+    while (rest.length > 0 && !workers_should_stop()) {
+        const String line = next_line(&rest);
+        if (line.length == 0) continue;
+
+        while (!workers_should_stop()) {
+            if (!db) db = connect_db(env->db_url.data);
+            if (!db) {
+                if (!backoff_wait(&backoff, "Replay")) break;
+                continue;
+            }
+            backoff_reset(&backoff);
+
+            const u64 started = monotonic_us();
+            OutgoingBatch batch;
+            ProcessStatus status = PROCESS_INVALID;
+            if (decode_outgoing(line, PAYLOAD_JSON, arena, &batch)) status = execute_outgoing(&batch, db, arena);
+            const i32 stats = batch.count > 1 ? ENVELOPE_STATS : batch.count == 1 ? (i32)batch.operations[0].action : OUTGOING_UNKNOWN;
+            const u64 elapsed = monotonic_us() - started;
+            ArenaReset(arena);
+
+            if (status == PROCESS_RETRY) {
+                PQfinish(db);
+                db = nullptr;
+                continue;
+            }
+            latency_record(&worker->stats[stats], elapsed, status == PROCESS_OK);
+            break;
+        }
+    }
+
+    if (db) PQfinish(db);
+    ArenaFree(arena);
+    return nullptr;
+}
+
+static void replay_report(ReplayWorker* workers, i32 worker_count, f64 elapsed_s) {
+    LatencyStats* totals = Malloc(sizeof(LatencyStats) * ACTION_COUNT);
+    memset(totals, 0, sizeof(LatencyStats) * ACTION_COUNT);
+    u64 count = 0, failed = 0;
+    for (i32 action = 0; action < ACTION_COUNT; action++) {
+        for (i32 i = 0; i < worker_count; i++) latency_merge(&totals[action], &workers[i].stats[action]);
+        count += totals[action].count;
+        failed += totals[action].failed;
+    }
+
+    LogSuccess("Replay: %" PRIu64 " messages (%" PRIu64 " failed) in %.2fs with %d workers, %.0f msg/s",
+               count, failed, elapsed_s, worker_count, elapsed_s > 0 ? count / elapsed_s : 0.0);
+    LogInfo("Replay: %-15s %10s %8s %10s %10s %10s %10s %10s", "action", "count", "failed", "mean_us", "p50_us", "p90_us",
+            "p99_us", "max_us");
+    for (i32 action = 0; action < ACTION_COUNT; action++) {
+        const LatencyStats* stats = &totals[action];
+        if (stats->count == 0) continue;
+        LogInfo("Replay: %-15s %10" PRIu64 " %8" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64,
+                action_names[action], stats->count, stats->failed, stats->total_us / stats->count,
+                latency_percentile(stats, 0.50), latency_percentile(stats, 0.90), latency_percentile(stats, 0.99),
+                stats->max_us);
+    }
+    Free(totals);
+}
+
+void run_replay(Dotenv* env) {
+    const int fd = open(env->replay_file.data, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LogError("Replay: Couldn't open '%s': %s", env->replay_file.data, strerror(errno));
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        LogWarn("Replay: '%s' is empty, nothing to replay.", env->replay_file.data);
+        close(fd);
+        return;
+    }
+    char* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LogError("Replay: Couldn't map '%s': %s", env->replay_file.data, strerror(errno));
+        return;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    /* Each worker gets a contiguous slice of the file, cut right after a newline so no line is split. */
+    const i32 worker_count = env->replay_workers;
+    ReplayWorker* workers = Malloc(sizeof(ReplayWorker) * worker_count);
+    pthread_t* threads = Malloc(sizeof(pthread_t) * worker_count);
+    memset(workers, 0, sizeof(ReplayWorker) * worker_count);
+    i64 start = 0;
+    for (i32 i = 0; i < worker_count; i++) {
+        i64 end = i == worker_count - 1 ? st.st_size : Max(start, (i64)st.st_size * (i + 1) / worker_count);
+        while (end > start && end < st.st_size && data[end - 1] != '\n') end++;
+        workers[i] = (ReplayWorker){ .env = env, .lines = { .length = end - start, .data = data + start } };
+        start = end;
+    }
+
+    LogInfo("Replay: Streaming '%s' (%lld bytes) with %d workers", env->replay_file.data, (long long)st.st_size, worker_count);
+    const u64 started = monotonic_us();
+    i32 running = 0;
+    for (i32 i = 0; i < worker_count; i++) {
+        if (pthread_create(&threads[running], nullptr, replay_worker_run, &workers[i]) != 0) {
+            LogError("Replay: Couldn't start worker %d, running its slice inline.", i);
+            replay_worker_run(&workers[i]);
+            continue;
+        }
+        running++;
+    }
+    for (i32 i = 0; i < running; i++) pthread_join(threads[i], nullptr);
+
+    replay_report(workers, worker_count, (monotonic_us() - started) / 1e6);
+    if (workers_should_stop()) LogWarn("Replay: Stopped before the end of the file.");
+
+    munmap(data, st.st_size);
+    Free(threads);
+    Free(workers);
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include "config.h"
+
+/* Replay streams a JSON-lines file of outgoing messages through the same decode and sink path the consumers use,
+ * without RabbitMQ in the loop. It serves both as a backfill tool after outages and as a broker-free benchmark,
+ * a throughput and per-action latency summary is printed once the file is exhausted. */
+
+void run_replay(Dotenv* env);
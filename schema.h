@@ -0,0 +1,56 @@
+#pragma once
+#include "intern.h"
+
+/* Every entity the consumer writes is described once here, the struct in library.h, its JSON parser in library.c and
+ * its upsert SQL and parameter binder in database.c are all generated from the same list, so they can't drift apart.
+ *
+ * Each entry is X(kind, name, presence, column_type): kind is INT, TEXT, SYMBOL (an interned low-cardinality
+ * string, see intern.h) or BOOL, name is both the struct field, the JSON key and the column, and an OPTIONAL field
+ * that arrives empty keeps whatever the row already had, or gets its column DEFAULT in a new row. column_type is the
+ * column's SQL type, every value is cast to it before it is written, so it has to match the table. The first entry is
+ * the conflict key of the upsert. */
+
+#define CHAT_TABLE "chats"
+#define CHAT_SCHEMA(X)                           \
+    X(INT,    id,           REQUIRED, "integer") \
+    X(SYMBOL, situation,    REQUIRED, "text")    \
+    X(BOOL,   is_active,    REQUIRED, "boolean") \
+    X(INT,    agent_id,     REQUIRED, "integer") \
+    X(SYMBOL, tabulation,   OPTIONAL, "text")    \
+    X(INT,    customer_id,  REQUIRED, "integer")
+
+#define MESSAGE_TABLE "messages"
+#define MESSAGE_SCHEMA(X)                        \
+    X(INT,    id,           REQUIRED, "integer") \
+    X(TEXT,   from,         REQUIRED, "text")    \
+    X(TEXT,   to,           REQUIRED, "text")    \
+    X(BOOL,   delivered,    REQUIRED, "boolean") \
+    X(TEXT,   text,         REQUIRED, "text")    \
+    X(INT,    chat_id,      REQUIRED, "integer")
+
+#define CUSTOMER_TABLE "customers"
+#define CUSTOMER_SCHEMA(X)                       \
+    X(INT,    id,           REQUIRED, "integer") \
+    X(TEXT,   name,         REQUIRED, "text")    \
+    X(TEXT,   number,       REQUIRED, "text")    \
+    X(TEXT,   last_chat_id, OPTIONAL, "integer")
+
+
+/* ====== [GENERATORS] ====== */
+
+#define SCHEMA_TYPE_INT i32
+#define SCHEMA_TYPE_TEXT String
+#define SCHEMA_TYPE_SYMBOL Symbol
+#define SCHEMA_TYPE_BOOL bool
+
+#define SCHEMA_OPTIONAL_OPTIONAL true
+#define SCHEMA_OPTIONAL_REQUIRED false
+
+#define SCHEMA_STRUCT_FIELD(kind, name, presence, column_type) SCHEMA_TYPE_##kind name;
+#define SCHEMA_FIELD_INDEX(kind, name, presence, column_type) SCHEMA_FIELD_##name,
+#define SCHEMA_JSON_KEY(kind, name, presence, column_type) JSON_KEY(#name),
+#define SCHEMA_COUNT_FIELD(kind, name, presence, column_type) + 1
+
+#define SCHEMA_FIELD_COUNT(SCHEMA) (0 SCHEMA(SCHEMA_COUNT_FIELD))
+
+/* ====== [GENERATORS] ====== */
@@ -0,0 +1,368 @@
+#include "worker.h"
+#include <stdatomic.h>
+#include <rabbitmq-c/amqp.h>
+#include "rabbit.h"
+#include "database.h"
+#include "redis.h"
+#include "process.h"
+#include "reconnect.h"
+
+#define WORKER_ARENA_SIZE (1024 * 1024)
+#define WORKER_POLL_SECONDS 1
+#define WORKER_DEPTH_CHECK_MS 1000
+/* While republishes wait for their confirm, reads on the consuming connection wait no longer than this. */
+#define WORKER_CONFIRM_POLL_MS 5
+
+static atomic_bool stop_requested = false;
+
+void workers_request_stop(void) {
+    atomic_store(&stop_requested, true);
+}
+
+bool workers_should_stop(void) {
+    return atomic_load(&stop_requested);
+}
+
+typedef struct {
+    Worker* worker;
+    amqp_connection_state_t rabbit;
+    /* Its connection is opened by reject_delivery the first time a delivery has to be republished. */
+    Publisher publisher;
+    /* Only set while a delivery or a batch flush holds a lease on a pooled connection. */
+    PGconn* db;
+    redisContext* redis;
+    Arena* arena;
+    RedisBatch* batch;
+    DbBatch* upserts;
+    Arena* staged_arena;
+    Delivery* staged;
+    i32 staged_count;
+    i64 staged_oldest_ms;
+    bool bulk;
+    i64 depth_checked_ms;
+    AckWindow acks;
+    Backoff backoff;
+    /* Set when a lease timed out, the worker then waits out db_backoff before it reads the next delivery. */
+    bool db_starved;
+    Backoff db_backoff;
+} WorkerContext;
+
+static void worker_forget_staged(WorkerContext* ctx) {
+    if (!ctx->upserts) return;
+    db_batch_reset(ctx->upserts);
+    ctx->staged_count = 0;
+    ArenaReset(ctx->staged_arena);
+}
+
+/* Unacknowledged deliveries are redelivered by the broker once the connection is gone,
+ * so the ack window and any half-built batch are simply forgotten. */
+static void worker_drop_rabbit(WorkerContext* ctx) {
+    drop_rabbitmq(ctx->rabbit);
+    ctx->rabbit = nullptr;
+    ack_window_reset(&ctx->acks, nullptr);
+    publisher_forget(&ctx->publisher);
+    if (ctx->batch) resetRedisBatch(ctx->batch);
+    worker_forget_staged(ctx);
+}
+
+/* The pool replaces a connection handed back as broken in the background, the next lease gets a working one. */
+static void worker_drop_db(WorkerContext* ctx) {
+    db_pool_release(ctx->worker->pool, ctx->db, true);
+    ctx->db = nullptr;
+}
+
+static void worker_lease_db(WorkerContext* ctx) {
+    if (ctx->db) return;
+    ctx->db = db_pool_acquire(ctx->worker->pool, ctx->worker->env->db_pool_timeout_ms);
+    ctx->db_starved = !ctx->db;
+    if (ctx->db) backoff_reset(&ctx->db_backoff);
+}
+
+static void worker_return_db(WorkerContext* ctx) {
+    db_pool_release(ctx->worker->pool, ctx->db, false);
+    ctx->db = nullptr;
+}
+
+static void worker_drop_redis(WorkerContext* ctx) {
+    redisFree(ctx->redis);
+    ctx->redis = nullptr;
+}
+
+/* Brings back whichever connections the worker lost, backing off between failed rounds.
+ * Returns false only when a stop was requested while waiting. */
+static bool worker_connect(WorkerContext* ctx) {
+    Worker* worker = ctx->worker;
+    Dotenv* env = worker->env;
+    while (!workers_should_stop()) {
+        if (!ctx->rabbit) {
+            ctx->rabbit = create_rabbitmq_consumer(env, worker->queue_name);
+            if (ctx->rabbit && worker->kind == WORKER_OUTGOING && !declare_retry_queues(ctx->rabbit, env, worker->queue_name)) {
+                drop_rabbitmq(ctx->rabbit);
+                ctx->rabbit = nullptr;
+            }
+            if (ctx->rabbit) ack_window_reset(&ctx->acks, ctx->rabbit);
+        }
+        if (!ctx->redis) {
+            ctx->redis = connectRedis(env->redis_url, ctx->arena);
+            ArenaReset(ctx->arena);
+        }
+        if (ctx->rabbit && ctx->redis) {
+            if (ctx->backoff.attempt > 0) LogSuccess("Worker %d: Reconnected.", worker->id);
+            backoff_reset(&ctx->backoff);
+            return true;
+        }
+        if (!backoff_wait(&ctx->backoff, "Worker")) break;
+    }
+    return false;
+}
+
+/* Makes everything handled since the last commit durable and then acknowledges it,
+ * an incoming batch that couldn't be written goes back to the queue instead. When the broker can't be told either
+ * way the connection is dropped like after a failed consume, so it redelivers whatever was left unacknowledged. */
+static void worker_commit(WorkerContext* ctx) {
+    bool settled;
+    if (ctx->batch && !flushRedisBatch(ctx->redis, ctx->batch)) {
+        resetRedisBatch(ctx->batch);
+        if (ctx->redis->err) worker_drop_redis(ctx);
+        settled = ack_window_requeue(&ctx->acks);
+    } else if (ctx->batch) {
+        /* Only the messages of chats Redis refused go back, everything else was written. */
+        u64* refused = ArenaAlloc(ctx->batch->arena, sizeof(u64) * (ctx->batch->message_count + 1));
+        i32 refused_count;
+        refusedRedisMessages(ctx->batch, refused, &refused_count);
+        settled = ack_window_requeue_some(&ctx->acks, refused, refused_count) && ack_window_flush(&ctx->acks);
+        resetRedisBatch(ctx->batch);
+    } else {
+        settled = ack_window_flush(&ctx->acks);
+    }
+    if (!settled) worker_drop_rabbit(ctx);
+}
+
+static void worker_settle(WorkerContext* ctx, const Delivery* delivery, ProcessStatus status, u64 requests_done) {
+    if (status == PROCESS_RETRY) {
+        /* The sink never saw this delivery, hand it back and reconnect before reading the next one. */
+        requeue_delivery(ctx->rabbit, delivery->delivery_tag);
+        if (ctx->db) worker_drop_db(ctx);
+    } else if (status == PROCESS_OK) {
+        ack_window_track(&ctx->acks, delivery->delivery_tag);
+    } else if (reject_delivery(&ctx->publisher, ctx->worker->queue_name, delivery, status == PROCESS_FAILED, requests_done,
+                               ctx->arena)) {
+        /* Settled by worker_collect_confirms once the broker confirmed the copy. */
+        ack_window_hold(&ctx->acks);
+    } else if (!requeue_delivery(ctx->rabbit, delivery->delivery_tag)) {
+        /* Neither republished nor requeued, the broker redelivers it once the connection is back. */
+        worker_drop_rabbit(ctx);
+    }
+}
+
+/* Acknowledges the originals of confirmed republishes and requeues the ones whose copy the broker didn't take. */
+static void worker_collect_confirms(WorkerContext* ctx, const struct timeval* timeout) {
+    PublishConfirm confirm;
+    while (ctx->rabbit && publisher_next_confirm(&ctx->publisher, timeout, &confirm)) {
+        if (!ack_window_release(&ctx->acks, confirm.delivery_tag, confirm.state == PUBLISH_CONFIRMED)) {
+            worker_drop_rabbit(ctx);
+        }
+    }
+}
+
+/* Writes the staged rows and settles their deliveries. One refused row fails the whole batch, so then every staged
+ * delivery is written again on its own and only the ones that still fail are rejected. */
+static void worker_flush_staged(WorkerContext* ctx) {
+    if (ctx->staged_count == 0) return;
+    worker_lease_db(ctx);
+    DbStatus status = DB_CONNECTION_LOST;
+    if (ctx->db) status = db_batch_flush(ctx->db, ctx->upserts, ctx->bulk);
+    else db_batch_reset(ctx->upserts);
+    for (i32 i = 0; i < ctx->staged_count && ctx->rabbit; i++) {
+        const Delivery* delivery = &ctx->staged[i];
+        if (status == DB_OK) {
+            ack_window_track(&ctx->acks, delivery->delivery_tag);
+        } else if (status == DB_CONNECTION_LOST || !ctx->db) {
+            worker_settle(ctx, delivery, PROCESS_RETRY, 0);
+        } else {
+            const PayloadFormat format = payload_format(delivery_content_type(delivery));
+            worker_settle(ctx, delivery, process_outgoing(delivery->body, format, ctx->db, ctx->arena), 0);
+        }
+    }
+    ctx->staged_count = 0;
+    ArenaReset(ctx->staged_arena);
+}
+
+static i64 worker_staged_due_in(const WorkerContext* ctx) {
+    if (ctx->staged_count == 0) return -1;
+    const i64 elapsed = TimeNow() - ctx->staged_oldest_ms;
+    return elapsed >= ctx->worker->env->upsert_batch_ms ? 0 : ctx->worker->env->upsert_batch_ms - elapsed;
+}
+
+/* Bulk mode is entered once the queue is BULK_QUEUE_DEPTH deep and left once it has drained to half of that, so a
+ * queue hovering around the threshold doesn't flip it on every check. */
+static void worker_check_depth(WorkerContext* ctx) {
+    Worker* worker = ctx->worker;
+    const i32 threshold = worker->env->bulk_queue_depth;
+    if (!ctx->upserts || threshold == 0 || TimeNow() - ctx->depth_checked_ms < WORKER_DEPTH_CHECK_MS) return;
+    ctx->depth_checked_ms = TimeNow();
+    const i64 depth = queue_depth(ctx->rabbit, worker->queue_name);
+    if (depth < 0) return;
+    const bool bulk = depth >= (ctx->bulk ? threshold / 2 : threshold);
+    if (bulk != ctx->bulk) {
+        LogInfo("Worker %d: %s bulk mode at a queue depth of %" PRIi64 ".", worker->id, bulk ? "Entering" : "Leaving", depth);
+    }
+    ctx->bulk = bulk;
+}
+
+/* Deliveries that only write rows wait in the DbBatch and are acknowledged once it is written. Their body is kept so
+ * they can still be written one by one, the frame buffer or worker Arena it is in is reused by the next read. */
+static bool worker_stage(WorkerContext* ctx, const Delivery* delivery, const OutgoingBatch* batch) {
+    const i32 capacity = ctx->bulk ? ctx->worker->env->bulk_batch : ctx->worker->env->upsert_batch;
+    if (capacity <= 1) return false;
+    if (ctx->staged_count >= capacity || db_batch_rows(ctx->upserts) + batch->count > capacity) {
+        worker_flush_staged(ctx);
+    }
+    if (!ctx->rabbit || !outgoing_stageable(batch, ctx->upserts, capacity)) return false;
+    if (stage_outgoing(batch, ctx->upserts) != PROCESS_OK) {
+        /* The rows it did stage are upserts, writing them with the others is harmless and the retry writes them again. */
+        worker_flush_staged(ctx);
+        if (ctx->rabbit) worker_settle(ctx, delivery, PROCESS_RETRY, 0);
+        return true;
+    }
+
+    if (ctx->staged_count == 0) ctx->staged_oldest_ms = TimeNow();
+    Delivery* staged = &ctx->staged[ctx->staged_count++];
+    *staged = *delivery;
+    staged->body_in_frame = true;
+    detach_delivery(staged, ctx->staged_arena);
+    if (ctx->staged_count >= capacity || db_batch_rows(ctx->upserts) >= capacity) {
+        worker_flush_staged(ctx);
+    }
+    return true;
+}
+
+static void worker_handle(WorkerContext* ctx, const Delivery* delivery) {
+    if (ctx->batch) {
+        /* A webhook that can't be parsed goes to the dead-letter queue like an invalid outgoing payload. */
+        if (process_incoming(delivery->body, delivery->delivery_tag, ctx->batch)) {
+            ack_window_track(&ctx->acks, delivery->delivery_tag);
+        } else if (ctx->rabbit) {
+            worker_settle(ctx, delivery, PROCESS_INVALID, 0);
+        }
+        if (ctx->acks.pending >= ctx->batch->capacity) {
+            worker_commit(ctx);
+        }
+        ArenaReset(ctx->arena);
+        return;
+    }
+
+    OutgoingBatch batch;
+    const bool decoded = decode_outgoing(delivery->body, payload_format(delivery_content_type(delivery)), ctx->arena, &batch);
+    batch.requests_done = delivery_requests_done(delivery);
+    if (decoded && ctx->upserts && worker_stage(ctx, delivery, &batch)) {
+        worker_return_db(ctx);
+        ArenaReset(ctx->arena);
+        return;
+    }
+
+    /* Acknowledgements are cumulative, so whatever is staged has to be settled before this delivery is. */
+    worker_flush_staged(ctx);
+    ProcessStatus status = PROCESS_INVALID;
+    if (decoded) {
+        worker_lease_db(ctx);
+        status = ctx->db ? execute_outgoing(&batch, ctx->db, ctx->arena) : PROCESS_RETRY;
+    }
+    if (ctx->rabbit) worker_settle(ctx, delivery, status, batch.requests_done);
+    worker_return_db(ctx);
+    ArenaReset(ctx->arena);
+}
+
+void* worker_run(void* arg) {
+    Worker* worker = arg;
+    Dotenv* env = worker->env;
+    WorkerContext ctx = {
+        .worker = worker,
+        .arena = ArenaCreate(WORKER_ARENA_SIZE),
+        .backoff = backoff_new(env->reconnect_base_ms, env->reconnect_max_ms),
+        .db_backoff = backoff_new(env->reconnect_base_ms, env->reconnect_max_ms),
+        .publisher = publisher_new(env),
+    };
+
+    /* Incoming deliveries are only acknowledged by worker_commit, once their batch reached Redis. */
+    if (worker->kind == WORKER_INCOMING) {
+        ctx.batch = newRedisBatch(env->incoming_batch);
+        ctx.acks = ack_window_new(nullptr, I32_MAX);
+    } else {
+        ctx.acks = ack_window_new(nullptr, env->ack_batch);
+        if (env->upsert_batch > 1 || env->bulk_queue_depth > 0) {
+            const i32 capacity = Max(env->upsert_batch, env->bulk_batch);
+            ctx.upserts = db_batch_new(capacity);
+            ctx.staged_arena = ArenaCreate(WORKER_ARENA_SIZE);
+            ctx.staged = Malloc(sizeof(Delivery) * capacity);
+        }
+    }
+
+    if (worker_connect(&ctx)) {
+        LogSuccess("Worker %d: Consuming from '%s'", worker->id, worker->queue_name);
+    }
+
+    const struct timeval no_wait = { 0 };
+    while (worker_connect(&ctx)) {
+        worker_collect_confirms(&ctx, &no_wait);
+        /* Without pending acks the timeout only exists so the loop can notice a stop request,
+         * with pending acks it is bounded by ACK_INTERVAL_MS so a slow trickle still gets committed. */
+        i64 due_in = ack_window_due_in(&ctx.acks, env->ack_interval_ms);
+        if (due_in == 0) {
+            worker_commit(&ctx);
+            continue;
+        }
+        worker_check_depth(&ctx);
+
+        /* Staged upserts wait no longer than UPSERT_BATCH_MS for the batch to fill. */
+        const i64 staged_due_in = worker_staged_due_in(&ctx);
+        if (staged_due_in == 0) {
+            worker_flush_staged(&ctx);
+            worker_return_db(&ctx);
+            ArenaReset(ctx.arena);
+            continue;
+        }
+        /* Whatever couldn't get a connection was requeued, reading on right away would only requeue the next ones too. */
+        if (ctx.db_starved) {
+            ctx.db_starved = false;
+            if (!backoff_wait(&ctx.db_backoff, "Worker DbPool")) break;
+            continue;
+        }
+        if (staged_due_in > 0 && (due_in < 0 || staged_due_in < due_in)) due_in = staged_due_in;
+        i64 wait_ms = due_in > 0 ? due_in : WORKER_POLL_SECONDS * 1000;
+        if (publisher_due_in(&ctx.publisher) >= 0) wait_ms = Min(wait_ms, WORKER_CONFIRM_POLL_MS);
+        const struct timeval timeout = { .tv_sec = wait_ms / 1000, .tv_usec = (wait_ms % 1000) * 1000 };
+
+        /* The body stays in librabbitmq's frame buffer or the worker Arena until the next read releases them. */
+        Delivery delivery;
+        amqp_maybe_release_buffers(ctx.rabbit);
+        const int status = read_delivery(ctx.rabbit, ctx.arena, &delivery, &timeout);
+        if (status == AMQP_STATUS_TIMEOUT) {
+            continue;
+        }
+        if (status != AMQP_STATUS_OK) {
+            LogError("Worker %d: Consume failed: %s", worker->id, amqp_error_string2(status));
+            worker_drop_rabbit(&ctx);
+            continue;
+        }
+        worker_handle(&ctx, &delivery);
+    }
+
+    if (ctx.rabbit) worker_flush_staged(&ctx);
+    worker_return_db(&ctx);
+    /* Republishes still get until PUBLISH_CONFIRM_MS to be confirmed, so their originals can be settled. */
+    const struct timeval confirm_wait = { .tv_usec = WORKER_CONFIRM_POLL_MS * 1000 };
+    while (ctx.rabbit && publisher_due_in(&ctx.publisher) >= 0) worker_collect_confirms(&ctx, &confirm_wait);
+    if (ctx.rabbit && (!ctx.batch || ctx.redis)) worker_commit(&ctx);
+    close_rabbitmq(ctx.rabbit);
+    publisher_close(&ctx.publisher);
+    ack_window_free(&ctx.acks);
+    if (ctx.redis) redisFree(ctx.redis);
+    freeRedisBatch(ctx.batch);
+    db_batch_free(ctx.upserts);
+    if (ctx.staged_arena) ArenaFree(ctx.staged_arena);
+    Free(ctx.staged);
+    ArenaFree(ctx.arena);
+    LogInfo("Worker %d: Stopped.", worker->id);
+    return nullptr;
+}
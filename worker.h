@@ -0,0 +1,26 @@
+#pragma once
+#include "config.h"
+#include "pool.h"
+
+/* A Worker is one consumer thread, it owns its own RabbitMQ and Redis connections and a per-thread Arena that is
+ * reset after every message. Postgres connections are leased from the shared DbPool for one delivery or one batch
+ * flush at a time. */
+
+typedef enum {
+    WORKER_OUTGOING = 0,
+    WORKER_INCOMING,
+} WorkerKind;
+
+typedef struct {
+    i32 id;
+    WorkerKind kind;
+    Dotenv* env;
+    const char* queue_name;
+    DbPool* pool;
+} Worker;
+
+void* worker_run(void* arg);
+
+void workers_request_stop(void);
+
+bool workers_should_stop(void);